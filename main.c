@@ -1,732 +1,7897 @@
-#include <stdio.h> // For printf, getline, perror, and fflush
-#include <stdlib.h> // For malloc and free
-#include <string.h> // For strtok_r
-#include <unistd.h> // For fork, execvp, and chdir
-#include <fcntl.h> // For open
-#include <ctype.h> // For isspace
-#include <signal.h> // For signal handling
-#include <sys/wait.h> // For parent pid waiting
-#include <errno.h> // For process checking
-
-// Store the command in a struct
-struct command {
-    char *name;
-    char **args;
-    int numArgs;
-    char *input;
-    char *output;
-    int ampersand; // 0 if no ampersand, 1 if ampersand
-};
-
-// Store the latest process in a struct
-struct process {
-    pid_t pid;
-    int status;
-    int exitStatus;
-    int exited;
-};
-
-// Store the latest process in a struct
-struct process2 {
-    pid_t pid;
-    int exitStatus;
-    int exited;
-    struct process2 *next;
-};
-
-struct background {
-    struct process *proc;
-    struct background *prev;
-    struct background *next;
-};
-
-struct process2 *terminated = NULL;
-int foregroundOnly = 0;
-int notForegroundOnly = 0;
-int activated = 0;
-int inProcess = 0;
-void handleSIGINT(int sigum) {
-    if(inProcess == 1) {
-        char *message = "terminated by signal 2\n";
-        write(STDOUT_FILENO, message, 24);
-        fflush(stdout);
-    }
-}
-
-void stopHandleSig(int sig) {
-    if(activated == 0) {
-        foregroundOnly = 1;
-        activated = 1;
-    } else {
-        notForegroundOnly = 1;
-        activated = 0;
-    }
-}
-
-void childHandleSig(int sig) {
-    pid_t pid;
-    int status;
-
-    while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        struct process2 *new = malloc(sizeof(struct process));
-        new->pid = pid;
- 
-        if(WIFEXITED(status)) {
-            new->exitStatus = WEXITSTATUS(status);
-            new->exited = 1;
-        } else {
-            new->exitStatus = WTERMSIG(status);
-            new->exited = 0;
-        }
-
-        new->next = terminated;
-        terminated = new;
-    }
-}
-
-// Processes a line of user input and returns a command struct with the command name, arguments, input, output, and ampersand flag
-struct command *processLine(char *currLine) {
-    if (currLine == NULL) {
-        return NULL;
-    }
-
-    struct command *curr = malloc(sizeof(struct command));
-    char *saveptr;
-
-    // Initialize the command
-    curr->name = NULL;
-    curr->args = NULL;
-    curr->numArgs = 0;
-    curr->input = NULL;
-    curr->output = NULL;
-    curr->ampersand = 0;
-
-    // Get the command name
-    char *token = strtok_r(currLine, " ", &saveptr);
-    curr->name = calloc(strlen(token) + 1, sizeof(char));
-    strcpy(curr->name, token);
-
-    // Get the arguments
-    int indexArg = 0;
-    token = strtok_r(NULL, " ", &saveptr);
-
-    // While there are still arguments to be read and the argument is not an input, output, or ampersand
-    while (token != NULL && strcmp(token, "<") != 0 && strcmp(token, ">") != 0 && strcmp(token, "&") != 0) {
-        // Store the argument in a new string
-        char *arg = calloc(strlen(token) + 1, sizeof(char));
-        strcpy(arg, token);
-
-        // Add the argument to the array of arguments
-        curr->args = realloc(curr->args, (indexArg + 1) * sizeof(char *));
-        curr->args[indexArg] = arg;
-        indexArg++;
-        curr->numArgs++;
-
-        // Get the next argument
-        token = strtok_r(NULL, " ", &saveptr);
-    }
-
-    // If the next argument is an input, output, or ampersand, then process it
-    if (token != NULL && strcmp(token, "<") == 0) {
-        // Get the part after the space and store it as the input
-        token = strtok_r(NULL, " ", &saveptr);
-        curr->input = calloc(strlen(token) + 1, sizeof(char));
-        strcpy(curr->input, token);
-    } else if (token != NULL && strcmp(token, ">") == 0) {
-        // Get the part after the space and store it as the output
-        token = strtok_r(NULL, " ", &saveptr);
-        curr->output = calloc(strlen(token) + 1, sizeof(char));
-        strcpy(curr->output, token);
-    } else if (token != NULL && strcmp(token, "&") == 0) {
-        curr->ampersand = 1; // Set the ampersand flag to true
-        return curr;         // Return the new command
-    }
-
-    token = strtok_r(NULL, " ", &saveptr);
-
-    // If the next argument is an output, input, or ampersand, then process it
-    if (token != NULL && strcmp(token, ">") == 0) {
-        // Get the part after the space and store it as the output
-        token = strtok_r(NULL, " ", &saveptr);
-        curr->output = calloc(strlen(token) + 1, sizeof(char));
-        strcpy(curr->output, token);
-    } else if (token != NULL && strcmp(token, "<") == 0) {
-        // Get the part after the space and store it as the input
-        token = strtok_r(NULL, " ", &saveptr);
-        curr->input = calloc(strlen(token) + 1, sizeof(char));
-        strcpy(curr->input, token);
-    } else if (token != NULL && strcmp(token, "&") == 0) {
-        curr->ampersand = 1; // Set the ampersand flag to true
-        return curr;         // Return the new command
-    }
-
-    token = strtok_r(NULL, " ", &saveptr);
-
-    // If the next argument is an ampersand, then process it
-    if (token != NULL && strcmp(token, "&") == 0) {
-        curr->ampersand = 1; // Set the ampersand flag to true
-    }
-
-    return curr; // Return the new command
-}
-
-// Counts the number of expansions in the input
-int countExpansions(char *input) {
-    int expansions = 0;
-    int length = strlen(input);
-
-    for (int i = 0; i < length; i++) {
-        if (input[i] == '$' && input[i + 1] == '$') {
-            expansions++;
-        }
-    }
-
-    return expansions;
-}
-
-// Performs the expansion of the variable
-char *variableExpansion(char *input, int expansions, int pid) {
-    // Calculate the new length of the command name
-    int length = strlen(input);
-    int pidSize = snprintf(NULL, 0, "%d", pid);
-
-    int newLength = length + (pidSize - 2) * expansions;
-    char *output = calloc(newLength + 1, sizeof(char));
-
-    int j = 0;
-    for (int i = 0; i < length; i++) {
-        if (input[i] == '$' && input[i + 1] == '$') {
-            // Expand the variable
-            sprintf(output + j, "%d", pid);
-            j += pidSize;
-            i++; // Skip the second '$'
-        } else {
-            // Copy the character
-            output[j] = input[i];
-            j++;
-        }
-    }
-
-    output[j] = '\0';
-    return output;
-}
-
-// Frees unneeded memory and sets the input to the output
-void freeAndSet(char **input, char *output) {
-    free(*input);
-    *input = malloc(strlen(output) * sizeof(char));
-    strcpy(*input, output);
-    free(output);
-}
-
-// Expands variables in the command
-struct command *expandVariables(struct command *curr, int pid) {
-    struct command *expand = curr;
-
-    // Expand the command name
-    int expansions = countExpansions(expand->name);
-    char *output = variableExpansion(expand->name, expansions, pid);
-    freeAndSet(&(expand->name), output);
-
-    // Expand the arguments
-    for (int i = 0; i < expand->numArgs; i++) {
-        expansions = countExpansions(expand->args[i]);
-        output = variableExpansion(expand->args[i], expansions, pid);
-        freeAndSet(&(expand->args[i]), output);
-    }
-
-    // Expand the input
-    if (expand->input != NULL) {
-        expansions = countExpansions(expand->input);
-        output = variableExpansion(expand->input, expansions, pid);
-        freeAndSet(&(expand->input), output);
-    }
-
-    // Expand the output
-    if (expand->output != NULL) {
-        expansions = countExpansions(expand->output);
-        output = variableExpansion(expand->output, expansions, pid);
-        freeAndSet(&(expand->output), output);
-    }
-
-    return expand;
-}
-
-// Function to execute CD
-void executeCD(struct command *curr) {
-    int result = 0;
-    char currentDir[2048]; // Stores the current directory
-
-    // If the user entered no arguments, then go to the home directory
-    if (curr->numArgs == 0) {
-        result = chdir(getenv("HOME"));
-        if (result != 0) {
-            perror("Failed to change directory");
-            fflush(stdout);
-            return;
-        }
-    // If the user entered one argument, then go to that directory
-    } else {
-        // If the user entered a relative path, then add the current directory
-        if (curr->args[0][0] != '/') {
-            if (getcwd(currentDir, sizeof(currentDir)) != NULL) {
-                strcat(currentDir, "/");
-                // Implement if there is a slash at the end, remove it
-                strcat(currentDir, curr->args[0]);
-                result = chdir(currentDir);
-                if (result != 0) {
-                    perror("Failed to change directory");
-                    fflush(stdout);
-                    return;
-                }
-            } else {
-                perror("Failed to get current directory");
-                fflush(stdout);
-                return;
-            }
-        } else {
-            result = chdir(curr->args[0]);
-            if (result != 0) {
-                perror("Failed to change directory");
-                fflush(stdout);
-                return;
-            }
-        }
-    }
-}
-
-// Function to redirect input
-int redirectInput(char *input) {
-    // Open the input file
-    int fd = open(input, O_RDONLY);
-
-    // Check if the open failed
-    if (fd == -1) {
-        perror("Failed to open file");
-        fflush(stdout);
-        return -1;
-    }
-
-    // Redirect the input and check if it failed
-    if (dup2(fd, 0) == -1) {
-        perror("Failed to redirect input");
-        fflush(stdout);
-        return -1;
-    }
-
-    // Return its status
-    return fd;
-}
-
-// Function to redirect output
-int redirectOutput(char *output) {
-    // Open the output file
-    int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-
-    // Check if the open failed
-    if (fd == -1) {
-        perror("Failed to open file");
-        fflush(stdout);
-        return -1;
-    }
-
-    // Redirect the output and check if it failed
-    if (dup2(fd, 1) == -1) {
-        perror("Failed to redirect output");
-        fflush(stdout);
-        return -1;
-    }
-
-    // Return its status
-    return fd;
-}
-
-void killChild(pid_t pid) {
-    int status;
-    waitpid(pid, &status, 0);
-    if (!WIFEXITED(status) && !WIFSIGNALED(status)) {
-        kill(pid, SIGKILL);
-    }
-}
-
-
-// Function to execute a command
-struct process *executeCommand(struct command *curr) {
-    if(curr->ampersand == 1) {
-        signal(SIGINT, SIG_IGN);
-    } else {
-        signal(SIGINT, handleSIGINT);
-    }
-    
-    // Fork a new process
-    int childStatus;
-    pid_t spawnPid = fork();
-
-    struct process *proc = malloc(sizeof(struct process));
-
-    // If the fork failed, then print an error
-    if (spawnPid == -1) {
-        inProcess = 0;
-        perror("Failed to fork");
-        fflush(stdin);
-        proc->exitStatus = 1;
-        proc->exited = 1;
-        exit(1);
-    } else if (spawnPid == 0) {
-        // Child
-        // Construct the argument array
-        inProcess = 1;
-        char *argv[curr->numArgs + 2];
-        argv[0] = curr->name;
-
-        for (int i = 0; i < curr->numArgs; i++) {
-            argv[i + 1] = curr->args[i];
-        }
-
-        argv[curr->numArgs + 1] = NULL;
-
-        // Redirect the input
-        if (curr->input != NULL) {
-            int inputFd = redirectInput(curr->input);
-
-            // Check if redirection failed
-            if(inputFd == -1) {
-                close(inputFd);
-                proc->exitStatus = 1;
-                proc->exited = 1;
-                exit(1);
-            }
-        }
-
-        // Redirect the output
-        if (curr->output != NULL) {
-            int outputFd = redirectOutput(curr->output);
-
-            // Check if redirection failed
-            if(outputFd == -1) {
-                close(outputFd);
-                proc->exitStatus = 1;
-                proc->exited = 1;
-                exit(1);
-            }
-        }
-
-        // Redirect the input and output if background process
-        if (curr->ampersand == 1) {
-            // Check if the input is not specified
-            if(curr->input == NULL) {
-                int inputFd = redirectInput("/dev/null");
-
-                // Check if redirection failed
-                if(inputFd == -1) {
-                    close(inputFd);
-                    proc->exitStatus = 1;
-                    proc->exited = 1;
-                    exit(1);
-                }
-            }
-
-            if(curr->output == NULL) {
-                // Check if the output is not specified
-                int outputFd = redirectOutput("/dev/null");
-
-                // Check if redirection failed
-                if(outputFd == -1) {
-                    close(outputFd);
-                    proc->exitStatus = 1;
-                    proc->exited = 1;
-                    exit(1);
-                }
-            }
-        }
-
-        execvp(curr->name, argv);
-
-        // If execvp returns, there was an error
-        perror("execvp failed");
-        fflush(stdout);
-        proc->exitStatus = 1;
-        proc->exited = 1;
-        inProcess = 0;
-        exit(1);
-    } else {
-        // Parent
-        inProcess = 0;
-        proc->pid = spawnPid;
-        proc->status = childStatus;
-
-        if(curr->ampersand == 0 || activated == 1) {
-            waitpid(spawnPid, &childStatus, 0);          
-
-            if(WIFEXITED(childStatus)) {
-                proc->exitStatus = WEXITSTATUS(childStatus);
-                if(proc->exitStatus != 0) {
-                    killChild(spawnPid);
-                }
-                proc->exited = 1;
-            } else {
-                proc->exitStatus = WTERMSIG(childStatus);
-                proc->exited = 0;
-            }
-            return proc;
-        } else {
-            printf("background pid is %d\n", spawnPid);
-            fflush(stdout);
-            waitpid(spawnPid, &childStatus, WNOHANG);         
-
-            return proc;
-        }
-    }
-}
-
-void buildList(struct background **list, struct process *proc) {
-    if(*list == NULL) {
-        (*list) = malloc(sizeof(struct background));
-        (*list)->proc = malloc(sizeof(struct process));
-        (*list)->proc = proc;
-        (*list)->prev = NULL;
-        (*list)->next = NULL;
-    } else {
-        struct background *curr = *list;
-        while(curr->next != NULL) {
-            curr = curr->next;
-        }
-
-        struct background *new = malloc(sizeof(struct background));
-        new->proc = proc;
-        new->prev = curr;
-        new->next = NULL;
-        curr->next = new;
-    }
-}
-
-void freeCommand(struct command *curr) {
-    if(curr != NULL) {
-        free(curr->name);
-        if(curr->args != NULL) {
-            for(int i = 0; i < curr->numArgs; i++) {
-                free(curr->args[i]);
-            }
-            free(curr->args);
-        }
-        if(curr->input != NULL) {
-            free(curr->input);
-        }
-        if(curr->output != NULL) {
-            free(curr->output);
-        }
-        free(curr);
-    }
-}
-
-void freeProcess(struct process *curr) {
-    if(curr != NULL) {
-        free(curr);
-    }
-}
-
-void freeProcess2(struct process2 *curr) {
-    if(curr != NULL) {
-        struct process2 *temp;
-        while(curr != NULL) {
-            temp = curr;
-            curr = curr->next;
-            free(temp);
-        }
-    }
-}
-
-void freeBackgroundList(struct background *list) {
-    if(list != NULL) {
-        struct background *temp;
-        while(list != NULL) {
-            temp = list;
-            list = list->next;
-            freeProcess(temp->proc);
-            free(temp);
-        }
-    }
-}
-
-void killChildren(struct background *list) {
-    struct background *curr = list;
-
-    while(curr != NULL) {
-        kill(curr->proc->pid, SIGTERM);
-        curr = curr->next;
-    }
-}
-
-// Function to execute exit
-void executeExit(struct background *list) {
-    killChildren(list);
-    freeBackgroundList(list);
-    exit(EXIT_SUCCESS);
-}
-
-// This function remove process that have exited or been terminated
-void removeProcesses(struct background **list) {
-    struct background *curr = *list;
-    struct process2 *curr2 = NULL;
-    struct process2 *currT = NULL;
-
-    currT = terminated;
-    terminated = NULL;
-    //freeProcess2(terminated);
-
-    while(curr != NULL) {
-        curr2 = currT;
-        while(curr2 != NULL) {
-            if(curr->proc->pid == curr2->pid) {
-                if(curr->prev == NULL) {
-                    if(curr->next == NULL) {
-                        (*list) = NULL;
-                    } else {
-                        curr->next->prev = NULL;
-                        (*list) = curr->next;
-                    }
-                } else {
-                    if(curr->next == NULL) {
-                        curr->prev->next = NULL;
-                    } else {
-                        curr->prev->next = curr->next;
-                        curr->next->prev = curr->prev;
-                    }
-                }
-
-                if(curr2->exited == 1) {
-                    printf("background pid %d is done: exit value %d\n", curr2->pid, curr2->exitStatus);
-                    fflush(stdout);
-                } else {
-                    printf("background pid %d is done: terminated by signal %d\n", curr2->pid, curr2->exitStatus);
-                    fflush(stdout);
-                }
-            }
-
-            curr2 = curr2->next;
-        }
-        curr = curr->next;
-    }
-
-    // freeProcess2(currT);
-    // freeProcess2(curr2);
-    // freeBackgroundList(curr);
-}
-
-int main(int argc, char *argv[]) {
-    char *userInput = NULL; // Stores the user input
-    struct process *currProc = malloc(sizeof(struct process));
-    struct process *bgProc = malloc(sizeof(struct process));
-    struct background *list = NULL;
-
-    // Set up signal handlers
-    signal(SIGINT, SIG_IGN);
-    signal(SIGTSTP, stopHandleSig);
-    signal(SIGCHLD, childHandleSig);
-
-    // Set up for getline
-    size_t len = 0;
-    ssize_t read;
-
-    // Loop until the user enters "exit"
-    do {
-
-        removeProcesses(&list);
-
-        if(foregroundOnly == 1) {
-            printf("Entering foreground-only mode (& is now ignored)\n");
-            fflush(stdout);
-            foregroundOnly = 0;
-        } else if(notForegroundOnly == 1) {
-            printf("Exiting foreground-only mode\n");
-            fflush(stdout);
-            notForegroundOnly = 0;
-        }
-
-        // Print the prompt and get the user input
-        printf(": ");
-        fflush(stdout);
-        read = getline(&userInput, &len, stdin);
-
-        // Check if the user entered only whitespace
-        int onlyWhiteSpace = 1;
-        for (size_t i = 0; i < strlen(userInput); i++) {
-            if (!isspace(userInput[i])) {
-                onlyWhiteSpace = 0;
-                break;
-            }
-        }
-
-        // If the user entered only whitespace, then jump to next iteration
-        if (onlyWhiteSpace == 1) {
-            continue;
-        // If they didn't, then process the input
-        } else {
-            // Replace the new line character with a space
-            if (read > 0 && userInput[strlen(userInput) - 1] == '\n')
-                userInput[strlen(userInput) - 1] = ' ';
-
-            // If the user entered a comment, then continue
-            if (userInput[0] == '#') {
-                continue;
-            // If the user typed a command, then make the command struct
-            } else {
-                struct command *curr = processLine(userInput); // Save command in struct
-                
-                // If the command struct is valid, then execute it
-                if (curr != NULL) {
-                    // Expand variables
-                    int pid = getpid();
-                    struct command *expand = expandVariables(curr, pid);
-
-                    // If the user types CD, execute the built in for it
-                    if (strcmp(expand->name, "cd") == 0) {
-                        executeCD(expand);
-                    // If the user types exit, execute the built in for it
-                    }
-                    else if (strcmp(expand->name, "exit") == 0) {
-                        freeCommand(expand);
-                        free(userInput);
-                        freeProcess(currProc);
-                        freeProcess(bgProc);
-                        // Need to impliment function to kill all children
-                        //freeBackgroundList(list);
-                        executeExit(list);
-                    // If the user types status, execute the built in for it
-                    }
-                    else if (strcmp(expand->name, "status") == 0) {
-                       if(currProc == NULL) {
-                        printf("exit value 0\n");
-                       } else {
-                            if(currProc->exited == 1) {
-                                printf("exit value %d\n", currProc->exitStatus);
-                            } else {
-                                printf("terminated by signal %d\n", currProc->exitStatus);
-                            }
-                       }
-                    // Otherwise, execute the command
-                    }
-                    else {
-                        if(expand->ampersand == 0) {
-                            currProc = executeCommand(expand);
-                        } else {
-                            bgProc = executeCommand(expand);
-                            buildList(&list, bgProc);
-                        }
-                    }
-
-                    freeCommand(expand);
-                    //free(userInput);
-                }
-            }
-        }
-
-    } while (strcmp(userInput, "exit ") != 0);
-
-    free(userInput);
-    freeProcess(currProc);
-    freeProcess(bgProc);
-    freeBackgroundList(list);
-
-    return 0;
-}
\ No newline at end of file
+#define _GNU_SOURCE // For splice and pipe2
+#include <stdio.h> // For printf, perror, and fflush
+#include <stdlib.h> // For malloc and free
+#include <string.h> // For strtok_r
+#include <unistd.h> // For fork, execvp, and chdir
+#include <fcntl.h> // For open
+#include <ctype.h> // For isspace
+#include <signal.h> // For signal handling
+#include <sys/wait.h> // For parent pid waiting
+#include <errno.h> // For process checking
+#include <spawn.h> // For posix_spawn
+#include <time.h> // For clock_gettime
+#include <poll.h> // For poll
+#include <sys/stat.h> // For stat
+#include <sys/mman.h> // For mmap
+#include <sys/time.h> // For timeradd
+#include <sys/resource.h> // For wait4 and struct rusage
+#include <sched.h> // For sched_setaffinity
+#include <sys/syscall.h> // For the io_uring system calls
+#include <sys/epoll.h> // For epoll
+#include <sys/uio.h> // For struct iovec
+#include <sys/socket.h> // For socketpair and SCM_RIGHTS
+#include <sys/file.h> // For flock
+#include <dirent.h> // For opendir
+#include <termios.h> // For the raw terminal mode
+#include <sys/ioctl.h> // For the terminal width
+#include <sys/inotify.h> // For watching $PATH directories
+#include <linux/io_uring.h> // For the io_uring structures
+
+extern char **environ;
+
+// Store the command in a struct
+struct command {
+    char *name;
+    char **args;
+    int numArgs;
+    char *input;
+    char *output;
+    int ampersand; // 0 if no ampersand, 1 if ampersand
+    struct command *next; // Next stage of a pipeline, NULL if this is the last
+    char *errput; // File for 2>, NULL if stderr is not redirected
+    int appendOutput; // 1 if the output was given with >>
+    int appendError; // 1 if the error file was given with 2>>
+    int errorToOutput; // 1 if 2>&1 sends stderr wherever stdout goes
+    struct deferredWord *deferred; // Words to expand each time the command runs
+    int numDeferred;
+    char **argTemplate; // Arguments as parsed, args is rebuilt from it when some are deferred
+    int numArgTemplate;
+    struct capture *capture; // Buffer the output goes to for command substitution, or NULL
+};
+
+// A word of a pre-parsed command whose $ expansions wait until the command runs
+struct deferredWord {
+    char **field; // Where the expanded text goes: the name or a file name
+    int arg; // Index in argTemplate if the word is an argument, -1 otherwise
+    const char *raw; // The word as written, quotes and all
+    int rawLength;
+};
+
+// Store the latest process in a struct
+struct process {
+    pid_t pid;
+    pid_t pgid; // Process group of a pipeline, 0 if it shares the shell's
+    int status;
+    int exitStatus;
+    int exited;
+    double started; // Monotonic times the command was launched and reaped
+    double finished;
+    struct rusage usage; // Summed over every stage of a pipeline
+    int pidfd; // pidfd of a background command, owned by childEpoll, -1 if there is none
+};
+
+// Exit record for a reaped child, from the SIGCHLD handler or a pidfd
+struct process2 {
+    pid_t pid;
+    int state; // JOB_DONE for an exit, JOB_STOPPED or JOB_RUNNING when a child stops or continues
+    int exitStatus; // Exit value, or the signal that ended or stopped it
+    int exited;
+    double finished;
+    struct rusage usage;
+};
+
+// Preallocated ring of exit records, filled by the SIGCHLD handler and emptied by the main loop
+#define EXIT_RING_SIZE 256
+struct exitRing {
+    struct process2 records[EXIT_RING_SIZE];
+    volatile sig_atomic_t head; // Next slot the handler writes
+    volatile sig_atomic_t tail; // Next slot the main loop reads
+    volatile sig_atomic_t overflow; // 1 if the handler left children unreaped because the ring was full
+};
+
+// States of a background job
+#define JOB_RUNNING 0
+#define JOB_STOPPED 1
+#define JOB_DONE 2
+
+// One background job
+struct job {
+    int id; // Job number, written %id
+    pid_t pid; // Process whose exit ends the job, the last stage of a pipeline
+    pid_t pgid; // Process group of the job, 0 if it shares the shell's
+    int state;
+    int exitStatus;
+    int exited;
+    char *text; // Command line the job was started from
+    char *cgroup; // Directory of the job's cgroup if it was started by limit, or NULL
+    double started; // Monotonic times the job was launched and reaped
+    double finished;
+    struct rusage usage;
+    int pidfd; // pidfd of pid, owned by childEpoll, -1 if there is none
+};
+
+// Background jobs in a dense array for iteration, indexed by pid through an open addressing table
+#define SLOT_EMPTY -1
+#define SLOT_DELETED -2
+struct jobTable {
+    struct job *jobs;
+    int count;
+    int capacity;
+    int *slots; // Index into jobs, or SLOT_EMPTY / SLOT_DELETED
+    int numSlots; // Always a power of two
+    int usedSlots; // Live and deleted slots, drives rehashing
+    int numDone; // Jobs that finished but were not reported yet
+    int nextId;
+};
+
+// Engines used to launch external commands
+#define LAUNCH_SPAWN 0
+#define LAUNCH_FORK 1
+
+struct exitRing exits;
+int wakePipe[2] = { -1, -1 }; // Written by signal handlers to wake the event loop
+int childEpoll = -1; // pidfds of the children reaped later and the wake pipe, -1 if SIGCHLD reaps them
+int exitFd = -1; // What the event loop polls for child exits, childEpoll or the wake pipe
+struct jobTable jobTable = { NULL, 0, 0, NULL, 0, 0, 0, 1 };
+int launchMode = LAUNCH_SPAWN;
+int interactive = 0; // 1 if the shell prints a prompt
+struct process *currProc = NULL; // Status of the last foreground command
+int spliceMode = 0; // 1 if the shell relays pipeline data with splice
+int notifyMode = 0; // 1 if finished jobs are reported as soon as they exit, set -b
+const char *activePrompt = NULL; // Prompt the shell is waiting at, NULL if it is not
+sigset_t shellMask; // Signal mask launched commands start with
+int jobControl = 0; // 1 if the shell owns its terminal, so each foreground job gets it in turn
+int foregroundOnly = 0;
+int notForegroundOnly = 0;
+int activated = 0;
+volatile sig_atomic_t interrupted = 0; // Set by SIGINT, stops a running loop
+void handleSIGINT(int sigum) {
+    interrupted = 1;
+}
+
+// Turns foreground-only mode on or off, announceForegroundMode prints the change
+void setForegroundOnly(int on) {
+    if(on == 1 && activated == 0) {
+        foregroundOnly = 1;
+        activated = 1;
+    } else if(on == 0 && activated == 1) {
+        notForegroundOnly = 1;
+        activated = 0;
+    }
+}
+
+// Returns the current monotonic time in seconds, safe to call from a signal handler
+double monotonicSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Kinds of trace events, named in traceNames
+#define TRACE_PARSE 0
+#define TRACE_EXPAND 1
+#define TRACE_EXECUTE 2
+#define TRACE_SPAWN 3
+#define TRACE_FORK 4
+#define TRACE_WAIT 5
+#define TRACE_REAP 6
+#define TRACE_REMOVE 7
+const char *traceNames[] = { "parse", "expand", "execute", "spawn", "fork", "wait", "reap", "remove" };
+
+// One trace event, written by the main loop or the SIGCHLD handler
+struct traceEvent {
+    long long ns; // Monotonic time
+    pid_t pid; // Child the event is about, 0 for the shell itself
+    short kind;
+    char phase; // 'B' begins a span, 'E' ends it, 'i' is an instant
+};
+
+// Ring of the most recent events. A slot is claimed with an atomic increment, so the
+// signal handler can record events in the middle of one being written by the main loop.
+#define TRACE_RING_SIZE 65536
+struct traceRing {
+    struct traceEvent *events; // NULL unless SMALLSH_TRACE is set
+    unsigned long next; // Events recorded so far, the next slot is next % TRACE_RING_SIZE
+    char *path; // Where the ring is written at exit
+    pid_t owner; // Only the shell writes the file, not a forked child
+};
+
+struct traceRing trace = { NULL, 0, NULL, 0 };
+
+// Records a trace event if tracing is on, safe to call from a signal handler
+void traceRecord(int kind, char phase, pid_t pid) {
+    if (trace.events == NULL) {
+        return;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    unsigned long slot = __atomic_fetch_add(&trace.next, 1, __ATOMIC_RELAXED);
+    struct traceEvent *event = &trace.events[slot % TRACE_RING_SIZE];
+    event->ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    event->pid = pid;
+    event->kind = kind;
+    event->phase = phase;
+}
+
+// Writes the ring to the trace file as Chrome trace JSON, oldest event first
+void flushTrace(void) {
+    if (trace.events == NULL || getpid() != trace.owner) {
+        return;
+    }
+
+    FILE *out = fopen(trace.path, "w");
+    if (out == NULL) {
+        perror(trace.path);
+        fflush(stdout);
+        return;
+    }
+
+    unsigned long end = trace.next;
+    unsigned long start = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+    fprintf(out, "{\"otherData\": {\"dropped\": %lu}, \"traceEvents\": [", start);
+    for (unsigned long i = start; i < end; i++) {
+        struct traceEvent *event = &trace.events[i % TRACE_RING_SIZE];
+        fprintf(out, "%s\n{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": %d, \"tid\": %d",
+                i == start ? "" : ",", traceNames[event->kind], event->phase, event->ns / 1e3,
+                trace.owner, trace.owner);
+        if (event->phase == 'i') {
+            fprintf(out, ", \"s\": \"p\"");
+        }
+        if (event->pid != 0) {
+            fprintf(out, ", \"args\": {\"pid\": %d}", event->pid);
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+}
+
+// Turns tracing on if SMALLSH_TRACE names a file. The variable is removed so shells run
+// from this one do not write over the same file.
+void initTrace(void) {
+    char *path = getenv("SMALLSH_TRACE");
+    if (path == NULL || path[0] == '\0') {
+        return;
+    }
+
+    trace.path = strdup(path);
+    trace.owner = getpid();
+    trace.events = calloc(TRACE_RING_SIZE, sizeof(struct traceEvent));
+    unsetenv("SMALLSH_TRACE");
+    atexit(flushTrace);
+}
+
+// Wakes the event loop, safe to call from a signal handler
+void wakeEventLoop(void) {
+    char byte = 0;
+
+    if (wakePipe[1] != -1) {
+        write(wakePipe[1], &byte, 1);
+    }
+}
+
+// Reaps children into the exit ring without allocating, so it is async-signal-safe
+void childHandleSig(int sig) {
+    int savedErrno = errno;
+    pid_t pid;
+    int status;
+
+    while(1) {
+        // Leave children as zombies once the ring is full, the main loop reaps them later
+        int next = (exits.head + 1) % EXIT_RING_SIZE;
+        if (next == exits.tail) {
+            exits.overflow = 1;
+            break;
+        }
+
+        struct process2 *new = &exits.records[exits.head];
+        pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &new->usage);
+        if (pid <= 0) {
+            break;
+        }
+
+        new->pid = pid;
+        new->finished = monotonicSeconds();
+        traceRecord(TRACE_REAP, 'i', pid);
+
+        // Background jobs stopped by SIGTTIN or kill -STOP, and continued, are reported too
+        new->state = JOB_DONE;
+        if (WIFSTOPPED(status)) {
+            new->state = JOB_STOPPED;
+            new->exitStatus = WSTOPSIG(status);
+            new->exited = 0;
+        } else if (WIFCONTINUED(status)) {
+            new->state = JOB_RUNNING;
+            new->exitStatus = 0;
+            new->exited = 0;
+        } else if(WIFEXITED(status)) {
+            new->exitStatus = WEXITSTATUS(status);
+            new->exited = 1;
+        } else {
+            new->exitStatus = WTERMSIG(status);
+            new->exited = 0;
+        }
+
+        // Publish the record only after it is fully written
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        exits.head = next;
+    }
+
+    wakeEventLoop();
+    errno = savedErrno;
+}
+
+// Returns the first slot to probe for a pid
+unsigned int jobSlot(struct jobTable *table, pid_t pid) {
+    return ((unsigned int)pid * 2654435761u) & (table->numSlots - 1);
+}
+
+// Returns the slot holding pid, or -1
+int findJobSlot(struct jobTable *table, pid_t pid) {
+    if (table->numSlots == 0) {
+        return -1;
+    }
+
+    unsigned int mask = table->numSlots - 1;
+    for (unsigned int i = jobSlot(table, pid); table->slots[i] != SLOT_EMPTY; i = (i + 1) & mask) {
+        if (table->slots[i] >= 0 && table->jobs[table->slots[i]].pid == pid) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Returns the job for a pid, or NULL
+struct job *findJob(struct jobTable *table, pid_t pid) {
+    int slot = findJobSlot(table, pid);
+    return slot == -1 ? NULL : &table->jobs[table->slots[slot]];
+}
+
+// Returns the job with a job number, or NULL
+struct job *findJobId(struct jobTable *table, int id) {
+    for (int i = 0; i < table->count; i++) {
+        if (table->jobs[i].id == id) {
+            return &table->jobs[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Points a free slot for pid at a job index
+void placeJob(struct jobTable *table, pid_t pid, int index) {
+    unsigned int mask = table->numSlots - 1;
+    unsigned int i = jobSlot(table, pid);
+
+    while (table->slots[i] >= 0) {
+        i = (i + 1) & mask;
+    }
+    if (table->slots[i] == SLOT_EMPTY) {
+        table->usedSlots++;
+    }
+    table->slots[i] = index;
+}
+
+// Rebuilds the slots so they stay under 70% full, dropping deleted markers
+void rehashJobs(struct jobTable *table) {
+    while ((table->count + 1) * 10 >= table->numSlots * 7) {
+        table->numSlots = table->numSlots == 0 ? 64 : table->numSlots * 2;
+    }
+
+    free(table->slots);
+    table->slots = malloc(table->numSlots * sizeof(int));
+    for (int i = 0; i < table->numSlots; i++) {
+        table->slots[i] = SLOT_EMPTY;
+    }
+    table->usedSlots = 0;
+
+    for (int i = 0; i < table->count; i++) {
+        placeJob(table, table->jobs[i].pid, i);
+    }
+}
+
+// Adds a background job, returns it
+struct job *addJob(struct jobTable *table, pid_t pid, pid_t pgid, char *text, double started) {
+    if ((table->usedSlots + 1) * 10 >= table->numSlots * 7) {
+        rehashJobs(table);
+    }
+    if (table->count == table->capacity) {
+        table->capacity = table->capacity == 0 ? 16 : table->capacity * 2;
+        table->jobs = realloc(table->jobs, table->capacity * sizeof(struct job));
+    }
+
+    if (table->count == 0) {
+        table->nextId = 1;
+    }
+
+    struct job *new = &table->jobs[table->count];
+    new->id = table->nextId++;
+    new->pid = pid;
+    new->pgid = pgid;
+    new->state = JOB_RUNNING;
+    new->exitStatus = 0;
+    new->exited = 1;
+    new->text = text;
+    new->cgroup = NULL;
+    new->started = started;
+    new->finished = 0;
+    memset(&new->usage, 0, sizeof(new->usage));
+    new->pidfd = -1;
+
+    placeJob(table, pid, table->count);
+    table->count++;
+
+    return new;
+}
+
+// Removes a cgroup once everything in it has exited
+void removeCgroup(char *dir) {
+    if (dir != NULL) {
+        rmdir(dir);
+        free(dir);
+    }
+}
+
+// Removes a job by moving the last job into its place
+void removeJob(struct jobTable *table, struct job *curr) {
+    int index = curr - table->jobs;
+    int last = table->count - 1;
+
+    table->slots[findJobSlot(table, curr->pid)] = SLOT_DELETED;
+    if (curr->state == JOB_DONE) {
+        table->numDone--;
+    }
+    free(curr->text);
+    removeCgroup(curr->cgroup);
+
+    if (index != last) {
+        table->jobs[index] = table->jobs[last];
+        table->slots[findJobSlot(table, table->jobs[index].pid)] = index;
+    }
+    table->count--;
+}
+
+// A command line in flight under the parallel builtin
+struct parallelSlot {
+    pid_t pid; // 0 if the slot is free
+    int line; // Index of the command line it runs
+};
+
+// State of a running parallel builtin
+struct parallelRun {
+    struct parallelSlot *slots;
+    int numSlots;
+    int running;
+    struct process2 *results; // Exit status of every command line, in input order
+};
+
+struct parallelRun *parallelRun = NULL;
+
+// Frees the slot of a parallel command that exited, returns 1 if it was one
+int recordParallelExit(struct process2 *record) {
+    if (parallelRun == NULL) {
+        return 0;
+    }
+
+    for (int i = 0; i < parallelRun->numSlots; i++) {
+        struct parallelSlot *slot = &parallelRun->slots[i];
+        if (slot->pid == record->pid) {
+            parallelRun->results[slot->line] = *record;
+            slot->pid = 0;
+            parallelRun->running--;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Marks the job a reaped child belonged to as done
+void recordExit(struct process2 *record) {
+    struct job *curr = findJob(&jobTable, record->pid);
+
+    // A stop or continue only changes the state of a job that is still around
+    if (record->state != JOB_DONE) {
+        if (curr != NULL && curr->state != JOB_DONE) {
+            curr->state = record->state;
+            curr->exitStatus = record->exitStatus;
+            curr->exited = 0;
+        }
+    } else if (curr == NULL) {
+        recordParallelExit(record);
+    } else if (curr->state != JOB_DONE) {
+        curr->state = JOB_DONE;
+        curr->exitStatus = record->exitStatus;
+        curr->exited = record->exited;
+        curr->finished = record->finished;
+        curr->usage = record->usage;
+        jobTable.numDone++;
+    }
+}
+
+// Rebuilds the text of a command line for the job table
+char *commandText(struct command *curr) {
+    size_t length = 3;
+    for (struct command *stage = curr; stage != NULL; stage = stage->next) {
+        length += strlen(stage->name) + 4;
+        for (int i = 0; i < stage->numArgs; i++) {
+            length += strlen(stage->args[i]) + 1;
+        }
+        length += stage->input == NULL ? 0 : strlen(stage->input) + 3;
+        length += stage->output == NULL ? 0 : strlen(stage->output) + 4;
+        length += stage->errput == NULL ? 0 : strlen(stage->errput) + 5;
+        length += stage->errorToOutput ? 5 : 0;
+    }
+
+    char *text = malloc(length);
+    text[0] = '\0';
+    for (struct command *stage = curr; stage != NULL; stage = stage->next) {
+        strcat(text, stage->name);
+        for (int i = 0; i < stage->numArgs; i++) {
+            strcat(text, " ");
+            strcat(text, stage->args[i]);
+        }
+        if (stage->input != NULL) {
+            strcat(text, " < ");
+            strcat(text, stage->input);
+        }
+        if (stage->output != NULL) {
+            strcat(text, stage->appendOutput ? " >> " : " > ");
+            strcat(text, stage->output);
+        }
+        if (stage->errput != NULL) {
+            strcat(text, stage->appendError ? " 2>> " : " 2> ");
+            strcat(text, stage->errput);
+        }
+        if (stage->errorToOutput == 1) {
+            strcat(text, " 2>&1");
+        }
+        if (stage->next != NULL) {
+            strcat(text, " | ");
+        }
+    }
+    if (curr->ampersand == 1) {
+        strcat(text, " &");
+    }
+
+    return text;
+}
+
+// Returns a pidfd for a child, or -1 if the kernel has none to give
+int openPidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Sends a signal through a pidfd, which always names the process it was opened for
+int sendPidfdSignal(int pidfd, int sig) {
+#ifdef SYS_pidfd_send_signal
+    return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Watches a child the shell does not wait for itself, so it is reaped through its pidfd.
+// Returns the pidfd, which childEpoll owns, or -1 if SIGCHLD reaps children instead.
+int trackChild(pid_t pid) {
+    if (childEpoll == -1 || pid <= 0) {
+        return -1;
+    }
+
+    // Only the shell reaps its children, so pid names this child until it is reaped
+    int pidfd = openPidfd(pid);
+    if (pidfd == -1) {
+        return -1;
+    }
+    fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = (uint64_t)(uint32_t)pid << 32 | (uint32_t)pidfd;
+    if (epoll_ctl(childEpoll, EPOLL_CTL_ADD, pidfd, &event) == -1) {
+        close(pidfd);
+        return -1;
+    }
+
+    return pidfd;
+}
+
+// Reaps the children whose pidfds turned readable and records their exits. waitid on the pidfd
+// only ever reaps that child, however soon its pid is handed out again.
+void harvestPidfds(void) {
+    struct epoll_event events[64];
+    int count;
+
+    do {
+        count = epoll_wait(childEpoll, events, 64, 0);
+        for (int i = 0; i < count; i++) {
+            int pidfd = (int)(uint32_t)events[i].data.u64;
+            pid_t pid = (pid_t)(events[i].data.u64 >> 32);
+
+            siginfo_t info;
+            struct process2 record;
+            memset(&info, 0, sizeof(info));
+            if (syscall(SYS_waitid, P_PIDFD, pidfd, &info, WEXITED | WNOHANG, &record.usage) == 0) {
+                if (info.si_pid == 0) {
+                    continue;
+                }
+                record.pid = pid;
+                record.state = JOB_DONE;
+                record.exitStatus = info.si_status;
+                record.exited = info.si_code == CLD_EXITED;
+                record.finished = monotonicSeconds();
+                traceRecord(TRACE_REAP, 'i', pid);
+                recordExit(&record);
+            }
+
+            // Done either way, a foreground wait or a group sweep may have reaped it already
+            struct job *curr = findJob(&jobTable, pid);
+            if (curr != NULL && curr->pidfd == pidfd) {
+                curr->pidfd = -1;
+            }
+            epoll_ctl(childEpoll, EPOLL_CTL_DEL, pidfd, NULL);
+            close(pidfd);
+        }
+    } while (count == 64);
+}
+
+// Moves exit records out of the ring into the job table, outside of signal context
+void collectExits(void) {
+    sigset_t block, old;
+
+    if (childEpoll != -1) {
+        harvestPidfds();
+        return;
+    }
+
+    while (exits.tail != exits.head) {
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        recordExit(&exits.records[exits.tail]);
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        exits.tail = (exits.tail + 1) % EXIT_RING_SIZE;
+    }
+
+    // Reap whatever the handler had to leave behind now that the ring has room again
+    if (exits.overflow == 1) {
+        sigemptyset(&block);
+        sigaddset(&block, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &block, &old);
+        exits.overflow = 0;
+        childHandleSig(SIGCHLD);
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        collectExits();
+    }
+}
+
+// Drains the wake pipe after the event loop wakes up
+void drainWakePipe(void) {
+    char buf[64];
+
+    while (read(wakePipe[0], buf, sizeof(buf)) > 0) {
+    }
+}
+
+// Sets up how children are reaped: through pidfds in an epoll set if the kernel can wait on a
+// pidfd, otherwise by the SIGCHLD handler, which the caller installs when childEpoll is -1.
+// SMALLSH_REAP=signal picks the handler either way.
+int initReaper(void) {
+    if (pipe2(wakePipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        return -1;
+    }
+    exitFd = wakePipe[0];
+
+    const char *mode = getenv("SMALLSH_REAP");
+    if (mode != NULL && strcmp(mode, "signal") == 0) {
+        return 0;
+    }
+
+    // waitid on the shell's own pidfd fails with ECHILD only if P_PIDFD is understood
+    int self = openPidfd(getpid());
+    siginfo_t info;
+    int supported = self != -1 && waitid(P_PIDFD, self, &info, WEXITED | WNOHANG) == -1 && errno == ECHILD;
+    if (self != -1) {
+        close(self);
+    }
+    if (supported) {
+        childEpoll = epoll_create1(EPOLL_CLOEXEC);
+        exitFd = childEpoll == -1 ? wakePipe[0] : childEpoll;
+    }
+
+    return 0;
+}
+
+// Buffered reader for the prompt that lets the event loop see child exits while waiting
+struct lineReader {
+    int fd;
+    char *buf;
+    size_t start; // First unread byte
+    size_t end; // One past the last buffered byte
+    size_t capacity;
+};
+
+struct lineReader stdinReader = { STDIN_FILENO, NULL, 0, 0, 0 };
+
+void removeProcesses(struct jobTable *table);
+void redrawPrompt(void);
+
+// Waits until the reader's fd is readable, collecting child exits that arrive meanwhile.
+// With set -b finished jobs are reported right away and the prompt is printed again.
+int waitForInput(struct lineReader *reader) {
+    struct pollfd fds[2];
+
+    while (1) {
+        fds[0].fd = reader->fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = exitFd;
+        fds[1].events = POLLIN;
+
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            drainWakePipe();
+            collectExits();
+            if (notifyMode == 1 && jobTable.numDone > 0 && activePrompt != NULL) {
+                printf("\n");
+                removeProcesses(&jobTable);
+                redrawPrompt();
+            }
+        }
+        if (fds[0].revents != 0) {
+            return 0;
+        }
+    }
+}
+
+// Reads the next line like getline, returns its length or -1 at end of input
+ssize_t readLine(struct lineReader *reader, char **line, size_t *len) {
+    while (1) {
+        // Hand out a complete line if one is buffered
+        size_t available = reader->end - reader->start;
+        char *newline = available == 0 ? NULL : memchr(reader->buf + reader->start, '\n', available);
+        ssize_t got = 0;
+
+        if (newline == NULL) {
+            // Make room for more input
+            if (reader->start > 0) {
+                memmove(reader->buf, reader->buf + reader->start, available);
+                reader->start = 0;
+                reader->end = available;
+            }
+            if (reader->end == reader->capacity) {
+                reader->capacity = reader->capacity == 0 ? 4096 : reader->capacity * 2;
+                reader->buf = realloc(reader->buf, reader->capacity);
+            }
+
+            if (waitForInput(reader) == 0) {
+                got = read(reader->fd, reader->buf + reader->end, reader->capacity - reader->end);
+            } else {
+                got = -1;
+            }
+            if (got == -1 && errno == EINTR) {
+                continue;
+            }
+            if (got > 0) {
+                reader->end += got;
+                continue;
+            }
+
+            // End of input, hand out an unterminated last line if there is one
+            if (available == 0) {
+                return -1;
+            }
+        }
+
+        size_t length = newline == NULL ? available : (size_t)(newline - (reader->buf + reader->start)) + 1;
+        if (*line == NULL || *len < length + 1) {
+            *len = length + 1;
+            *line = realloc(*line, *len);
+        }
+        memcpy(*line, reader->buf + reader->start, length);
+        (*line)[length] = '\0';
+        reader->start += length;
+
+        return length;
+    }
+}
+
+// Block of memory handed out by an arena
+struct arenaBlock {
+    struct arenaBlock *prev; // Earlier, full block
+    size_t capacity;
+    char data[];
+};
+
+// Bump allocator for everything parsed and expanded from a command line, released all at once
+struct arena {
+    struct arenaBlock *block; // Block allocations currently come from
+    size_t used; // Bytes handed out from the current block
+    unsigned long requests; // Allocations served
+    unsigned long blocks; // Blocks malloc'd to serve them
+    int direct; // 1 if every request is its own malloc and a reset frees it, for --bench
+};
+
+#define ARENA_BLOCK_SIZE 4096
+
+struct arena lineArena = { NULL, 0, 0, 0, 0 }; // Holds the line being run
+
+// Hands out size bytes, 8-byte aligned, from the arena
+void *arenaAlloc(struct arena *arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    arena->requests++;
+
+    // Start a bigger block when the current one is full
+    if (arena->direct == 1 || arena->block == NULL || arena->used + size > arena->block->capacity) {
+        size_t capacity = arena->block == NULL ? ARENA_BLOCK_SIZE : arena->block->capacity * 2;
+        if (arena->direct == 1) {
+            capacity = size;
+        }
+        while (capacity < size) {
+            capacity *= 2;
+        }
+
+        struct arenaBlock *new = malloc(sizeof(struct arenaBlock) + capacity);
+        new->prev = arena->block;
+        new->capacity = capacity;
+        arena->block = new;
+        arena->used = 0;
+        arena->blocks++;
+    }
+
+    void *memory = arena->block->data + arena->used;
+    arena->used += size;
+    return memory;
+}
+
+// Releases everything handed out. The newest block is the largest, so it is kept
+// and after the first few lines a reset is just moving the pointer back.
+void arenaReset(struct arena *arena) {
+    if (arena->block == NULL) {
+        return;
+    }
+
+    struct arenaBlock *old = arena->direct == 1 ? arena->block : arena->block->prev;
+    while (old != NULL) {
+        struct arenaBlock *temp = old;
+        old = old->prev;
+        free(temp);
+    }
+
+    arena->used = 0;
+    if (arena->direct == 1) {
+        arena->block = NULL;
+    } else {
+        arena->block->prev = NULL;
+    }
+}
+
+// Releases the arena's memory
+void arenaFree(struct arena *arena) {
+    arenaReset(arena);
+    free(arena->block);
+    arena->block = NULL;
+}
+
+// Allocates an empty command
+struct command *newCommand(struct arena *arena) {
+    struct command *curr = arenaAlloc(arena, sizeof(struct command));
+
+    // Initialize the command
+    curr->name = NULL;
+    curr->args = NULL;
+    curr->numArgs = 0;
+    curr->input = NULL;
+    curr->output = NULL;
+    curr->ampersand = 0;
+    curr->next = NULL;
+    curr->errput = NULL;
+    curr->appendOutput = 0;
+    curr->appendError = 0;
+    curr->errorToOutput = 0;
+    curr->deferred = NULL;
+    curr->numDeferred = 0;
+    curr->argTemplate = NULL;
+    curr->numArgTemplate = 0;
+    curr->capture = NULL;
+
+    return curr;
+}
+
+// Copies a token into the arena
+char *copyToken(struct arena *arena, char *token) {
+    size_t length = strlen(token);
+    char *copy = arenaAlloc(arena, length + 1);
+    memcpy(copy, token, length + 1);
+    return copy;
+}
+
+// One remembered command location
+struct hashEntry {
+    char *name; // NULL if the slot is empty
+    char *path;
+    int hits;
+};
+
+// Open addressing table from command name to absolute path, filled on first lookup
+struct commandHash {
+    struct hashEntry *entries;
+    int capacity; // Always a power of two
+    int count;
+    char *path; // Copy of $PATH the entries were resolved against
+};
+
+struct commandHash pathCache = { NULL, 0, 0, NULL };
+
+// FNV-1a hash of a string
+unsigned int hashString(const char *str) {
+    unsigned int hash = 2166136261u;
+
+    while (*str != '\0') {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// Forgets every remembered location
+void clearCommandHash(struct commandHash *table) {
+    for (int i = 0; i < table->capacity; i++) {
+        free(table->entries[i].name);
+        free(table->entries[i].path);
+        table->entries[i].name = NULL;
+        table->entries[i].path = NULL;
+        table->entries[i].hits = 0;
+    }
+    table->count = 0;
+    free(table->path);
+    table->path = NULL;
+}
+
+// Returns the slot for a name, either the matching entry or the empty slot it belongs in
+struct hashEntry *findHashSlot(struct commandHash *table, const char *name) {
+    unsigned int mask = table->capacity - 1;
+    unsigned int i = hashString(name) & mask;
+
+    while (table->entries[i].name != NULL && strcmp(table->entries[i].name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+
+    return &table->entries[i];
+}
+
+// Doubles the table once it is 70% full
+void growCommandHash(struct commandHash *table) {
+    struct hashEntry *old = table->entries;
+    int oldCapacity = table->capacity;
+
+    table->capacity = oldCapacity == 0 ? 64 : oldCapacity * 2;
+    table->entries = calloc(table->capacity, sizeof(struct hashEntry));
+
+    for (int i = 0; i < oldCapacity; i++) {
+        if (old[i].name != NULL) {
+            *findHashSlot(table, old[i].name) = old[i];
+        }
+    }
+
+    free(old);
+}
+
+// Walks $PATH for an executable named name, returns a new string or NULL
+char *searchPath(const char *name, const char *path) {
+    size_t nameLen = strlen(name);
+
+    while (path != NULL) {
+        const char *end = strchr(path, ':');
+        size_t dirLen = end == NULL ? strlen(path) : (size_t)(end - path);
+
+        // An empty entry means the current directory
+        char *candidate = malloc(dirLen + nameLen + 3);
+        if (dirLen == 0) {
+            strcpy(candidate, ".");
+            dirLen = 1;
+        } else {
+            memcpy(candidate, path, dirLen);
+        }
+        candidate[dirLen] = '/';
+        strcpy(candidate + dirLen + 1, name);
+
+        struct stat info;
+        if (stat(candidate, &info) == 0 && S_ISREG(info.st_mode) && access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+
+        path = end == NULL ? NULL : end + 1;
+    }
+
+    return NULL;
+}
+
+// Returns the absolute path to run for a command name, or NULL if it is not on $PATH.
+// Names with a slash are used as they are. refresh forces the name to be looked up again.
+const char *resolveCommand(const char *name, int refresh) {
+    struct commandHash *table = &pathCache;
+
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+
+    // Any change to $PATH makes every remembered location suspect
+    const char *path = getenv("PATH");
+    if (path == NULL) {
+        path = "/usr/local/bin:/usr/bin:/bin";
+    }
+    if (table->path == NULL || strcmp(table->path, path) != 0) {
+        if (table->count > 0) {
+            clearCommandHash(table);
+        }
+        free(table->path);
+        table->path = strdup(path);
+    }
+
+    if ((table->count + 1) * 10 >= table->capacity * 7) {
+        growCommandHash(table);
+    }
+
+    struct hashEntry *entry = findHashSlot(table, name);
+    if (entry->name != NULL && refresh == 0) {
+        entry->hits++;
+        return entry->path;
+    }
+
+    char *found = searchPath(name, path);
+    if (found == NULL) {
+        return NULL;
+    }
+
+    if (entry->name == NULL) {
+        entry->name = strdup(name);
+        table->count++;
+    }
+    free(entry->path);
+    entry->path = found;
+    entry->hits++;
+
+    return entry->path;
+}
+
+// Function to execute hash: list remembered locations, -r forgets them, names are looked up now
+void executeHash(struct command *curr) {
+    struct commandHash *table = &pathCache;
+
+    if (curr->numArgs == 0) {
+        if (table->count == 0) {
+            printf("hash: hash table empty\n");
+        } else {
+            printf("hits\tcommand\n");
+            for (int i = 0; i < table->capacity; i++) {
+                if (table->entries[i].name != NULL) {
+                    printf("%4d\t%s\n", table->entries[i].hits, table->entries[i].path);
+                }
+            }
+        }
+        fflush(stdout);
+        return;
+    }
+
+    for (int i = 0; i < curr->numArgs; i++) {
+        if (strcmp(curr->args[i], "-r") == 0) {
+            clearCommandHash(table);
+        } else if (resolveCommand(curr->args[i], 1) == NULL) {
+            printf("hash: %s: not found\n", curr->args[i]);
+            fflush(stdout);
+        }
+    }
+}
+
+// Kinds of tokens the lexer produces
+#define TOKEN_WORD 0
+#define TOKEN_PIPE 1 // |
+#define TOKEN_AMPERSAND 2 // &
+#define TOKEN_INPUT 3 // <
+#define TOKEN_OUTPUT 4 // >
+#define TOKEN_APPEND 5 // >>
+#define TOKEN_ERROR 6 // 2>
+#define TOKEN_ERROR_APPEND 7 // 2>>
+#define TOKEN_ERROR_TO_OUTPUT 8 // 2>&1
+#define TOKEN_OUTPUT_BOTH 9 // &>
+#define TOKEN_SEMI 10 // ;
+#define TOKEN_AND 11 // &&
+#define TOKEN_OR 12 // ||
+
+// A token is an offset into the line it was lexed from, words are unescaped in place.
+// A word an expansion made longer than its source is built in the arena instead.
+struct token {
+    int type;
+    int start;
+    int length;
+    char *text; // Word text in the arena, NULL if it is in the line at start
+    const char *raw; // Source of a word whose expansion was deferred, NULL otherwise
+    int rawLength;
+};
+
+// How lexLine treats $ expansions
+#define LEX_EXPAND 0 // Expand while lexing
+#define LEX_DEFER 1 // Keep the source of words with expansions so they can be expanded when run
+
+// States of the lexer
+#define LEX_BETWEEN 0 // Skipping blanks between tokens
+#define LEX_WORD 1 // Inside an unquoted part of a word
+#define LEX_SINGLE 2 // Inside '...'
+#define LEX_DOUBLE 3 // Inside "..."
+
+// Growable token buffer reused by every call to lexLine
+struct token *tokenBuffer = NULL;
+int tokenCapacity = 0;
+
+// The shell's pid, formatted once for $$
+char pidString[16];
+int pidLength = 0;
+
+// Environment variables by name for $NAME, so expansion never scans environ
+struct commandHash envCache = { NULL, 0, 0, NULL };
+
+// Stores a variable's value in envCache, which takes ownership of name
+void cacheVariable(char *name, const char *value) {
+    if ((envCache.count + 1) * 10 >= envCache.capacity * 7) {
+        growCommandHash(&envCache);
+    }
+    struct hashEntry *entry = findHashSlot(&envCache, name);
+    if (entry->name == NULL) {
+        entry->name = name;
+        envCache.count++;
+    } else {
+        free(name);
+        free(entry->path);
+    }
+    entry->path = strdup(value);
+}
+
+// Formats $$ and loads the environment into envCache
+void initExpansion(void) {
+    pidLength = snprintf(pidString, sizeof(pidString), "%d", getpid());
+
+    clearCommandHash(&envCache);
+    for (char **env = environ; *env != NULL; env++) {
+        char *equals = strchr(*env, '=');
+        if (equals != NULL) {
+            cacheVariable(strndup(*env, equals - *env), equals + 1);
+        }
+    }
+}
+
+// Sets a variable for the shell's expansions and in the environment of the commands it runs
+void setVariable(const char *name, const char *value) {
+    setenv(name, value, 1);
+    if (envCache.capacity > 0) {
+        cacheVariable(strdup(name), value);
+    }
+}
+
+// Returns the value of an environment variable, or NULL if it is not set
+const char *lookupVariable(const char *name, int length) {
+    char key[256];
+
+    if (length >= (int)sizeof(key)) {
+        return NULL;
+    }
+    memcpy(key, name, length);
+    key[length] = '\0';
+
+    if (envCache.capacity == 0) {
+        return getenv(key);
+    }
+
+    struct hashEntry *entry = findHashSlot(&envCache, key);
+    return entry->name == NULL ? NULL : entry->path;
+}
+
+int lastExitCode(void);
+
+// State of one lexLine call
+struct lexer {
+    char *line;
+    int in; // Next byte to read
+    int out; // Next byte of the current word to write, while it is built in place
+    struct arena *arena;
+    int mode;
+    const char *pristine; // Unmodified copy of the line for deferred words, NULL if it has no $
+    char *buf; // Arena copy of the current word once an expansion outgrew the source
+    int bufLength;
+    int bufCapacity;
+    int wordStart; // Offset of the current word in the line
+    int quoted; // 1 if the current word had quotes, so it survives being empty
+    int expanded; // 1 if the current word had an expansion
+    int dynamic; // 1 if the current word's expansion was deferred
+};
+
+// Appends bytes to the word being built, moving it into the arena if it no longer fits in place
+void lexPut(struct lexer *lx, const char *bytes, int length) {
+    if (lx->buf == NULL && lx->out + length <= lx->in) {
+        memmove(lx->line + lx->out, bytes, length);
+        lx->out += length;
+        return;
+    }
+
+    if (lx->buf == NULL || lx->bufLength + length + 1 > lx->bufCapacity) {
+        int used = lx->buf == NULL ? lx->out - lx->wordStart : lx->bufLength;
+        int capacity = (used + length + 1) * 2;
+        if (capacity < 64) {
+            capacity = 64;
+        }
+
+        char *grown = arenaAlloc(lx->arena, capacity);
+        memcpy(grown, lx->buf == NULL ? lx->line + lx->wordStart : lx->buf, used);
+        lx->buf = grown;
+        lx->bufLength = used;
+        lx->bufCapacity = capacity;
+    }
+
+    memcpy(lx->buf + lx->bufLength, bytes, length);
+    lx->bufLength += length;
+}
+
+int matchParen(const char *line, int start);
+
+// Handles the $ at the read position: $$, $?, $NAME and ${NAME}. Returns -1 on a bad ${.
+// With LEX_DEFER a $(...) or `...` is kept whole, its pipeline is reparsed when it runs.
+int lexDollar(struct lexer *lx, const char **error) {
+    char *p = lx->line + lx->in + 1;
+    const char *value = NULL;
+    char status[16];
+    int consumed;
+
+    if (lx->mode == LEX_DEFER && (p[-1] == '`' || *p == '(')) {
+        char *close = p[-1] == '`' ? strchr(p, '`') : NULL;
+        int end = p[-1] == '`' ? (close == NULL ? -1 : close - lx->line + 1) : matchParen(lx->line, lx->in);
+        if (end == -1) {
+            *error = "unexpected end of line while looking for the end of a command substitution";
+            return -1;
+        }
+        consumed = end - lx->in;
+    } else if (*p == '$') {
+        value = pidString;
+        consumed = 2;
+    } else if (*p == '?') {
+        snprintf(status, sizeof(status), "%d", lastExitCode());
+        value = status;
+        consumed = 2;
+    } else if (*p == '{') {
+        char *end = strchr(p, '}');
+        if (end == NULL) {
+            *error = "bad substitution";
+            return -1;
+        }
+        value = lookupVariable(p + 1, end - p - 1);
+        consumed = end - p + 2;
+    } else if (*p == '_' || isalpha((unsigned char)*p)) {
+        char *end = p;
+        while (*end == '_' || isalnum((unsigned char)*end)) {
+            end++;
+        }
+        value = lookupVariable(p, end - p);
+        consumed = end - p + 1;
+    } else {
+        // A lone $ is just a character
+        lexPut(lx, "$", 1);
+        lx->in++;
+        return 0;
+    }
+
+    // Deferred words only remember that they need expanding, their text is redone later
+    lx->in += consumed;
+    lx->expanded = 1;
+    if (lx->mode == LEX_DEFER) {
+        lx->dynamic = 1;
+        lexPut(lx, lx->line + lx->in - consumed, consumed);
+    } else if (value != NULL) {
+        lexPut(lx, value, strlen(value));
+    }
+
+    return 0;
+}
+
+// Appends a token to the shared buffer, returns the new count
+int pushToken(int count, int type, int start, int length) {
+    if (count == tokenCapacity) {
+        tokenCapacity = tokenCapacity == 0 ? 64 : tokenCapacity * 2;
+        tokenBuffer = realloc(tokenBuffer, tokenCapacity * sizeof(struct token));
+    }
+
+    tokenBuffer[count].type = type;
+    tokenBuffer[count].start = start;
+    tokenBuffer[count].length = length;
+    tokenBuffer[count].text = NULL;
+    tokenBuffer[count].raw = NULL;
+    tokenBuffer[count].rawLength = 0;
+    return count + 1;
+}
+
+// Ends the current word and pushes it, unless it was an unquoted expansion to nothing
+int pushWord(struct lexer *lx, int count) {
+    int length = lx->buf == NULL ? lx->out - lx->wordStart : lx->bufLength;
+
+    if (length == 0 && lx->quoted == 0 && lx->expanded == 1 && lx->dynamic == 0) {
+        return count;
+    }
+
+    count = pushToken(count, TOKEN_WORD, lx->wordStart, length);
+    struct token *token = &tokenBuffer[count - 1];
+    if (lx->buf != NULL) {
+        lx->buf[lx->bufLength] = '\0';
+        token->text = lx->buf;
+    }
+    if (lx->dynamic == 1) {
+        token->raw = lx->pristine + lx->wordStart;
+        token->rawLength = lx->in - lx->wordStart;
+    }
+
+    return count;
+}
+
+// Returns the operator token starting at line, and its length in *length, or -1 if there is none
+int lexOperator(const char *line, int *length) {
+    switch (line[0]) {
+    case '|':
+        *length = line[1] == '|' ? 2 : 1;
+        return line[1] == '|' ? TOKEN_OR : TOKEN_PIPE;
+    case '&':
+        *length = line[1] == '>' || line[1] == '&' ? 2 : 1;
+        return line[1] == '>' ? TOKEN_OUTPUT_BOTH : (line[1] == '&' ? TOKEN_AND : TOKEN_AMPERSAND);
+    case ';':
+        *length = 1;
+        return TOKEN_SEMI;
+    case '<':
+        *length = 1;
+        return TOKEN_INPUT;
+    case '>':
+        *length = line[1] == '>' ? 2 : 1;
+        return line[1] == '>' ? TOKEN_APPEND : TOKEN_OUTPUT;
+    case '2':
+        if (line[1] != '>') {
+            return -1;
+        }
+        if (line[2] == '&' && line[3] == '1') {
+            *length = 4;
+            return TOKEN_ERROR_TO_OUTPUT;
+        }
+        *length = line[2] == '>' ? 3 : 2;
+        return line[2] == '>' ? TOKEN_ERROR_APPEND : TOKEN_ERROR;
+    }
+
+    return -1;
+}
+
+// Splits a line into tokens in a single pass, expanding $ as it goes (or, with LEX_DEFER,
+// marking the words that need it). Quotes and backslashes are removed by compacting each
+// word toward its start, so most words stay inside the line and need no copy.
+// Returns the number of tokens in tokenBuffer, or -1 with *error set.
+int lexLine(struct arena *arena, char *line, int mode, const char **error) {
+    struct lexer lx;
+    int count = 0;
+    int state = LEX_BETWEEN;
+
+    lx.line = line;
+    lx.in = 0;
+    lx.arena = arena;
+    lx.mode = mode;
+    lx.pristine = NULL;
+
+    // Deferred words are expanded later from an untouched copy of their source
+    if (mode == LEX_DEFER && strpbrk(line, "$`") != NULL) {
+        lx.pristine = copyToken(arena, line);
+    }
+
+    while (1) {
+        char c = line[lx.in];
+
+        switch (state) {
+        case LEX_BETWEEN:
+            if (c == '\0' || c == '\n' || c == '#') {
+                return count;
+            }
+            if (c == ' ' || c == '\t' || c == '\r') {
+                lx.in++;
+                break;
+            }
+
+            // Operators, 2> only counts at the start of a word
+            int length;
+            int type = lexOperator(line + lx.in, &length);
+            if (type != -1) {
+                count = pushToken(count, type, lx.in, length);
+                lx.in += length;
+                break;
+            }
+
+            lx.wordStart = lx.out = lx.in;
+            lx.buf = NULL;
+            lx.quoted = lx.expanded = lx.dynamic = 0;
+            state = LEX_WORD;
+            break;
+
+        case LEX_WORD:
+            if (c == '\0' || c == '\n' || c == ' ' || c == '\t' || c == '\r' ||
+                c == '|' || c == '&' || c == '<' || c == '>' || c == ';') {
+                count = pushWord(&lx, count);
+                state = LEX_BETWEEN;
+            } else if (c == '\'') {
+                state = LEX_SINGLE;
+                lx.quoted = 1;
+                lx.in++;
+            } else if (c == '"') {
+                state = LEX_DOUBLE;
+                lx.quoted = 1;
+                lx.in++;
+            } else if (c == '$' || (c == '`' && mode == LEX_DEFER)) {
+                if (lexDollar(&lx, error) == -1) {
+                    return -1;
+                }
+            } else if (c == '\\') {
+                // The next byte is taken literally, a trailing backslash is dropped
+                if (line[lx.in + 1] != '\0' && line[lx.in + 1] != '\n') {
+                    lx.in += 2;
+                    lexPut(&lx, line + lx.in - 1, 1);
+                } else {
+                    lx.in++;
+                }
+            } else {
+                lx.in++;
+                lexPut(&lx, &c, 1);
+            }
+            break;
+
+        case LEX_SINGLE:
+            if (c == '\0') {
+                *error = "unexpected end of line while looking for matching '";
+                return -1;
+            }
+            lx.in++;
+            if (c == '\'') {
+                state = LEX_WORD;
+            } else {
+                lexPut(&lx, &c, 1);
+            }
+            break;
+
+        case LEX_DOUBLE:
+            if (c == '\0') {
+                *error = "unexpected end of line while looking for matching \"";
+                return -1;
+            }
+            if (c == '"') {
+                state = LEX_WORD;
+                lx.in++;
+            } else if (c == '$' || (c == '`' && mode == LEX_DEFER)) {
+                if (lexDollar(&lx, error) == -1) {
+                    return -1;
+                }
+            } else if (c == '\\' && (line[lx.in + 1] == '"' || line[lx.in + 1] == '\\' || line[lx.in + 1] == '$')) {
+                lx.in += 2;
+                lexPut(&lx, line + lx.in - 1, 1);
+            } else {
+                lx.in++;
+                lexPut(&lx, &c, 1);
+            }
+            break;
+        }
+    }
+}
+
+// Returns the text of a word token, terminating it in the line if that is where it lives
+char *tokenText(char *line, struct token *token) {
+    if (token->text != NULL) {
+        return token->text;
+    }
+
+    line[token->start + token->length] = '\0';
+    return line + token->start;
+}
+
+// Prints a syntax error about a token, or about the end of the line
+void syntaxError(char *line, struct token *token) {
+    static const char *names[] = { "word", "|", "&", "<", ">", ">>", "2>", "2>>", "2>&1", "&>", ";", "&&", "||" };
+
+    printf("syntax error near '%s'\n", token == NULL ? "newline" :
+           (token->type == TOKEN_WORD ? tokenText(line, token) : names[token->type]));
+    fflush(stdout);
+}
+
+// Stores a word in a command field, remembering its source if it has to be expanded later
+void setWord(struct command *curr, char **field, char *line, struct token *token) {
+    *field = tokenText(line, token);
+
+    if (token->raw != NULL) {
+        struct deferredWord *word = &curr->deferred[curr->numDeferred++];
+        int isArg = field >= curr->args && field < curr->args + curr->numArgs;
+        word->field = isArg ? NULL : field;
+        word->arg = isArg ? field - curr->args : -1;
+        word->raw = token->raw;
+        word->rawLength = token->rawLength;
+        if (isArg) {
+            curr->argTemplate = curr->args;
+        }
+    }
+}
+
+char *substituteCommands(struct arena *arena, char *line);
+
+// Returns 1 if a line may contain a command substitution
+int hasSubstitution(const char *line) {
+    return strstr(line, "$(") != NULL || strchr(line, '`') != NULL;
+}
+
+// Builds the chain of command structs for the pipeline in tokens start..count-1 of a line
+struct command *parsePipeline(struct arena *arena, char *currLine, struct token *tokens, int start, int count) {
+    struct command *head = newCommand(arena);
+    struct command *curr = head;
+    int stageStart = start;
+
+    for (int i = start; i < count; i++) {
+        struct token *token = &tokens[i];
+
+        // Size the argument and deferred word arrays from the words in this stage
+        if (i == stageStart) {
+            int words = 0;
+            int dynamic = 0;
+            for (int j = i; j < count && tokens[j].type != TOKEN_PIPE; j++) {
+                words += tokens[j].type == TOKEN_WORD;
+                dynamic += tokens[j].raw != NULL;
+            }
+            curr->args = arenaAlloc(arena, (words > 0 ? words : 1) * sizeof(char *));
+            if (dynamic > 0) {
+                curr->deferred = arenaAlloc(arena, dynamic * sizeof(struct deferredWord));
+            }
+        }
+
+        switch (token->type) {
+        case TOKEN_WORD:
+            if (curr->name == NULL) {
+                setWord(curr, &curr->name, currLine, token);
+            } else {
+                curr->numArgs++;
+                setWord(curr, &curr->args[curr->numArgs - 1], currLine, token);
+            }
+            break;
+
+        case TOKEN_PIPE:
+            // Start the next stage of the pipeline, every stage needs a command name
+            if (curr->name == NULL || i + 1 == count) {
+                syntaxError(currLine, token);
+                return NULL;
+            }
+            curr->next = newCommand(arena);
+            curr = curr->next;
+            stageStart = i + 1;
+            break;
+
+        case TOKEN_AMPERSAND:
+            // & only makes sense at the end of the line
+            if (i + 1 != count) {
+                syntaxError(currLine, token);
+                return NULL;
+            }
+            head->ampersand = 1;
+            break;
+
+        case TOKEN_ERROR_TO_OUTPUT:
+            curr->errorToOutput = 1;
+            break;
+
+        case TOKEN_SEMI:
+        case TOKEN_AND:
+        case TOKEN_OR:
+            // Lists are built by parseList, a single pipeline cannot have them
+            syntaxError(currLine, token);
+            return NULL;
+
+        default:
+            // Every other operator is a redirection followed by a file name
+            if (i + 1 == count || tokens[i + 1].type != TOKEN_WORD) {
+                syntaxError(currLine, i + 1 == count ? NULL : &tokens[i + 1]);
+                return NULL;
+            }
+            i++;
+
+            if (token->type == TOKEN_INPUT) {
+                setWord(curr, &curr->input, currLine, &tokens[i]);
+            } else if (token->type == TOKEN_OUTPUT || token->type == TOKEN_APPEND) {
+                setWord(curr, &curr->output, currLine, &tokens[i]);
+                curr->appendOutput = token->type == TOKEN_APPEND;
+            } else if (token->type == TOKEN_OUTPUT_BOTH) {
+                // &> file is > file 2>&1
+                setWord(curr, &curr->output, currLine, &tokens[i]);
+                curr->errorToOutput = 1;
+            } else {
+                setWord(curr, &curr->errput, currLine, &tokens[i]);
+                curr->appendError = token->type == TOKEN_ERROR_APPEND;
+            }
+            break;
+        }
+    }
+
+    if (curr->name == NULL) {
+        syntaxError(currLine, NULL);
+        return NULL;
+    }
+
+    // The whole pipeline runs in the background
+    for (curr = head; curr != NULL; curr = curr->next) {
+        curr->ampersand = head->ampersand;
+        if (curr->argTemplate != NULL) {
+            curr->argTemplate = curr->args;
+            curr->numArgTemplate = curr->numArgs;
+        }
+    }
+
+    return head; // Return the new command
+}
+
+// Builds the chain of command structs for processLine
+struct command *parseLine(struct arena *arena, char *currLine, int mode) {
+    if (currLine == NULL) {
+        return NULL;
+    }
+
+    const char *error = NULL;
+    int count = lexLine(arena, currLine, mode, &error);
+    if (count == -1) {
+        printf("%s\n", error);
+        fflush(stdout);
+        return NULL;
+    }
+    if (count == 0) {
+        return NULL;
+    }
+
+    return parsePipeline(arena, currLine, tokenBuffer, 0, count);
+}
+
+// Expands one deferred word into the arena, returns NULL if it expanded to nothing
+char *expandWord(struct arena *arena, const char *raw, int rawLength) {
+    char *copy = arenaAlloc(arena, rawLength + 1);
+    const char *error = NULL;
+
+    memcpy(copy, raw, rawLength);
+    copy[rawLength] = '\0';
+
+    if (lexLine(arena, copy, LEX_EXPAND, &error) < 1) {
+        return NULL;
+    }
+    return tokenText(copy, &tokenBuffer[0]);
+}
+
+// Processes a line of user input and returns a chain of command structs, one per pipeline stage,
+// with the command name, arguments, redirections, and ampersand flag. Variables are expanded
+// as the line is lexed, or with LEX_DEFER each time expandVariables is called. Words point into
+// the line itself, everything else is allocated from the arena and goes away when it is reset.
+struct command *processLine(struct arena *arena, char *currLine, int mode) {
+    traceRecord(TRACE_PARSE, 'B', 0);
+
+    // $(...) and `...` run first and their output is spliced into the line
+    if (mode == LEX_EXPAND && hasSubstitution(currLine)) {
+        currLine = substituteCommands(arena, currLine);
+        if (currLine == NULL) {
+            traceRecord(TRACE_PARSE, 'E', 0);
+            return NULL;
+        }
+    }
+
+    struct command *curr = parseLine(arena, currLine, mode);
+    traceRecord(TRACE_PARSE, 'E', 0);
+
+    return curr;
+}
+
+// Expands the deferred words in every stage of the command, new strings come from the arena.
+// Commands lexed with LEX_EXPAND have none, so this costs nothing for them.
+struct command *expandVariables(struct arena *arena, struct command *curr) {
+    traceRecord(TRACE_EXPAND, 'B', 0);
+    for (struct command *expand = curr; expand != NULL; expand = expand->next) {
+        if (expand->numDeferred == 0) {
+            continue;
+        }
+
+        // The arguments are rebuilt from the template so a command can be expanded again
+        char **args = expand->args;
+        if (expand->argTemplate != NULL) {
+            args = arenaAlloc(arena, expand->numArgTemplate * sizeof(char *));
+            memcpy(args, expand->argTemplate, expand->numArgTemplate * sizeof(char *));
+        }
+
+        for (int i = 0; i < expand->numDeferred; i++) {
+            struct deferredWord *word = &expand->deferred[i];
+            char *text = expandWord(arena, word->raw, word->rawLength);
+
+            // A name or file name that expanded to nothing is an empty string
+            if (word->arg >= 0) {
+                args[word->arg] = text;
+            } else {
+                *word->field = text == NULL ? "" : text;
+            }
+        }
+
+        // Unquoted arguments that expanded to nothing are dropped
+        if (expand->argTemplate != NULL) {
+            expand->numArgs = 0;
+            for (int i = 0; i < expand->numArgTemplate; i++) {
+                if (args[i] != NULL) {
+                    args[expand->numArgs++] = args[i];
+                }
+            }
+            expand->args = args;
+        }
+    }
+    traceRecord(TRACE_EXPAND, 'E', 0);
+
+    return curr;
+}
+
+// Function to execute CD
+void executeCD(struct command *curr) {
+    int result = 0;
+    char currentDir[2048]; // Stores the current directory
+
+    // Relative $PATH entries now point somewhere else
+    if (pathCache.count > 0) {
+        clearCommandHash(&pathCache);
+    }
+
+    // If the user entered no arguments, then go to the home directory
+    if (curr->numArgs == 0) {
+        result = chdir(getenv("HOME"));
+        if (result != 0) {
+            perror("Failed to change directory");
+            fflush(stdout);
+            return;
+        }
+    // If the user entered one argument, then go to that directory
+    } else {
+        // If the user entered a relative path, then add the current directory
+        if (curr->args[0][0] != '/') {
+            if (getcwd(currentDir, sizeof(currentDir)) != NULL) {
+                strcat(currentDir, "/");
+                // Implement if there is a slash at the end, remove it
+                strcat(currentDir, curr->args[0]);
+                result = chdir(currentDir);
+                if (result != 0) {
+                    perror("Failed to change directory");
+                    fflush(stdout);
+                    return;
+                }
+            } else {
+                perror("Failed to get current directory");
+                fflush(stdout);
+                return;
+            }
+        } else {
+            result = chdir(curr->args[0]);
+            if (result != 0) {
+                perror("Failed to change directory");
+                fflush(stdout);
+                return;
+            }
+        }
+    }
+}
+
+// A finished command's resource usage, kept for the timing builtin
+struct timing {
+    char *text;
+    double wall; // Seconds from launch to reaping
+    struct rusage usage;
+    int exitStatus;
+    int exited;
+};
+
+// The most recent commands, oldest overwritten first
+#define TIMING_LOG_SIZE 64
+struct timing timingLog[TIMING_LOG_SIZE];
+int timingCount = 0; // Commands recorded since the shell started
+double reportTime = -1; // Commands that take at least this many seconds are reported, -1 if off
+double shutdownGrace = 2; // Seconds jobs get to exit after SIGTERM when the shell exits
+
+// Returns a timeval in seconds
+double timevalSeconds(struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// Adds one process's usage to a total, the peak RSS is the largest of them
+void addUsage(struct rusage *total, struct rusage *part) {
+    timeradd(&total->ru_utime, &part->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &part->ru_stime, &total->ru_stime);
+    if (part->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = part->ru_maxrss;
+    }
+    total->ru_minflt += part->ru_minflt;
+    total->ru_majflt += part->ru_majflt;
+    total->ru_nvcsw += part->ru_nvcsw;
+    total->ru_nivcsw += part->ru_nivcsw;
+}
+
+// Prints one line of timing, numbered if number is positive
+void printTiming(struct timing *curr, int number) {
+    if (number > 0) {
+        printf("%5d  ", number);
+    }
+    printf("%.3fs real %.3fs user %.3fs sys %ldKB rss %ld/%ld faults %ld/%ld csw %s %d  %s\n",
+           curr->wall, timevalSeconds(&curr->usage.ru_utime), timevalSeconds(&curr->usage.ru_stime),
+           curr->usage.ru_maxrss, curr->usage.ru_minflt, curr->usage.ru_majflt,
+           curr->usage.ru_nvcsw, curr->usage.ru_nivcsw,
+           curr->exited ? "exit" : "signal", curr->exitStatus, curr->text);
+    fflush(stdout);
+}
+
+// Logs a finished command and reports it if it ran past the threshold, takes ownership of text
+void recordTiming(char *text, struct process *proc) {
+    struct timing *curr = &timingLog[timingCount % TIMING_LOG_SIZE];
+
+    free(curr->text);
+    curr->text = text;
+    curr->wall = proc->finished - proc->started;
+    curr->usage = proc->usage;
+    curr->exitStatus = proc->exitStatus;
+    curr->exited = proc->exited;
+    timingCount++;
+
+    if (reportTime >= 0 && curr->wall >= reportTime) {
+        printTiming(curr, 0);
+    }
+}
+
+// Logs a finished background job, its text moves to the log
+void recordJobTiming(struct job *curr) {
+    struct process proc;
+    proc.exitStatus = curr->exitStatus;
+    proc.exited = curr->exited;
+    proc.started = curr->started;
+    proc.finished = curr->finished;
+    proc.usage = curr->usage;
+
+    recordTiming(curr->text, &proc);
+    curr->text = NULL;
+}
+
+// Function to execute timing: timing [count], lists the most recent commands oldest first
+void executeTiming(struct command *curr) {
+    int count = curr->numArgs > 0 ? atoi(curr->args[0]) : 10;
+    int kept = timingCount < TIMING_LOG_SIZE ? timingCount : TIMING_LOG_SIZE;
+
+    if (count <= 0 || count > kept) {
+        count = kept;
+    }
+    for (int i = timingCount - count; i < timingCount; i++) {
+        printTiming(&timingLog[i % TIMING_LOG_SIZE], i + 1);
+    }
+}
+
+// Resource limits the limit builtin puts on the command it runs
+struct limits {
+    cpu_set_t cpus;
+    int hasCpus;
+    long long memory; // Bytes, 0 if not limited
+    int cpuWeight; // cgroup cpu.weight from 1 to 10000, 0 if not set
+    char *cgroup; // Directory of the command's cgroup, NULL if cgroups could not be used
+    int cgroupProcs; // cgroup.procs of that directory, -1 if there is none
+    int memoryInCgroup; // 1 if memory.max took the limit, otherwise it falls back to RLIMIT_AS
+    int weightInCgroup; // 1 if cpu.weight took the weight, otherwise it falls back to nice
+};
+
+struct limits *launchLimits = NULL; // Applied to every process launched while it is set
+int numCgroups = 0; // cgroups created so far, names them
+
+// Parses a CPU list such as 0-3,6 into a set, returns -1 if it is malformed
+int parseCpuList(const char *list, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+
+    while (*list != '\0') {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        list = end;
+    }
+
+    return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+// Parses a size such as 512M or 2G into bytes, returns -1 if it is malformed
+long long parseSize(const char *size) {
+    char *end;
+    long long value = strtoll(size, &end, 10);
+
+    if (end == size || value <= 0) {
+        return -1;
+    }
+    switch (*end) {
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+    }
+
+    return *end == '\0' ? value : -1;
+}
+
+// Returns the cgroup v2 directory the shell runs in, or NULL if there is no cgroup v2 hierarchy
+const char *shellCgroup(void) {
+    static char dir[4096 + sizeof("/sys/fs/cgroup")]; // Room for any line of /proc/self/cgroup
+    static int looked = 0;
+
+    if (looked == 0) {
+        looked = 1;
+        FILE *in = fopen("/proc/self/cgroup", "r");
+        char line[4096];
+        while (in != NULL && fgets(line, sizeof(line), in) != NULL) {
+            if (strncmp(line, "0::", 3) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                snprintf(dir, sizeof(dir), "/sys/fs/cgroup%s", strcmp(line + 3, "/") == 0 ? "" : line + 3);
+            }
+        }
+        if (in != NULL) {
+            fclose(in);
+        }
+
+        // A v1 hierarchy has the same line but no cgroup.controllers
+        char controllers[4200];
+        snprintf(controllers, sizeof(controllers), "%s/cgroup.controllers", dir);
+        if (dir[0] == '\0' || access(controllers, R_OK) == -1) {
+            dir[0] = '\0';
+        }
+    }
+
+    return dir[0] == '\0' ? NULL : dir;
+}
+
+// Writes a value to a file in a cgroup directory, returns -1 on failure
+int writeCgroupFile(const char *dir, const char *file, const char *value) {
+    char path[4200];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    int result = write(fd, value, strlen(value)) == (ssize_t)strlen(value) ? 0 : -1;
+    close(fd);
+
+    return result;
+}
+
+// Reads a number from a cgroup file, from the line starting with key if key is not NULL.
+// Returns -1 if it is missing.
+long long readCgroupValue(const char *dir, const char *file, const char *key) {
+    char path[4200];
+    char line[256];
+    long long value = -1;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (key == NULL) {
+            value = atoll(line);
+            break;
+        }
+        size_t length = strlen(key);
+        if (strncmp(line, key, length) == 0 && line[length] == ' ') {
+            value = atoll(line + length + 1);
+            break;
+        }
+    }
+    fclose(in);
+
+    return value;
+}
+
+// Creates a cgroup for the command next to the shell's own. Anything the cgroup cannot
+// enforce falls back to an rlimit or nice in the child, so limit works without delegation.
+void openLimitCgroup(struct limits *limits) {
+    static int warned = 0;
+    const char *base = shellCgroup();
+    char dir[4200];
+    char value[32];
+
+    limits->cgroup = NULL;
+    limits->cgroupProcs = -1;
+    limits->memoryInCgroup = 0;
+    limits->weightInCgroup = 0;
+
+    snprintf(dir, sizeof(dir), "%s/smallsh-%d-%d", base == NULL ? "" : base, getpid(), ++numCgroups);
+    if (base == NULL || mkdir(dir, 0755) == -1) {
+        if (warned == 0) {
+            printf("limit: cgroup v2 is not writable, using rlimits and nice instead\n");
+            fflush(stdout);
+            warned = 1;
+        }
+        return;
+    }
+
+    // Controllers may already be on for the subtree, or this may fail because the shell's
+    // cgroup has processes in it. Either way, the files written below tell.
+    writeCgroupFile(base, "cgroup.subtree_control", "+cpu +memory");
+    if (limits->memory > 0) {
+        snprintf(value, sizeof(value), "%lld", limits->memory);
+        limits->memoryInCgroup = writeCgroupFile(dir, "memory.max", value) == 0;
+    }
+    if (limits->cpuWeight > 0) {
+        snprintf(value, sizeof(value), "%d", limits->cpuWeight);
+        limits->weightInCgroup = writeCgroupFile(dir, "cpu.weight", value) == 0;
+    }
+
+    char procs[4300];
+    snprintf(procs, sizeof(procs), "%s/cgroup.procs", dir);
+    limits->cgroupProcs = open(procs, O_WRONLY | O_CLOEXEC);
+    if (limits->cgroupProcs == -1) {
+        rmdir(dir);
+        return;
+    }
+    limits->cgroup = strdup(dir);
+}
+
+// Puts the calling process under the limits, runs in the child between fork and exec
+void applyLimits(struct limits *limits) {
+    if (limits->cgroupProcs != -1) {
+        write(limits->cgroupProcs, "0", 1);
+    }
+    if (limits->hasCpus == 1 && sched_setaffinity(0, sizeof(cpu_set_t), &limits->cpus) == -1) {
+        perror("limit: sched_setaffinity");
+    }
+    if (limits->memory > 0 && limits->memoryInCgroup == 0) {
+        struct rlimit rl = { limits->memory, limits->memory };
+        setrlimit(RLIMIT_AS, &rl);
+    }
+
+    // cpu.weight 100 is nice 0 and each step of nice is about 25% less weight
+    if (limits->cpuWeight > 0 && limits->weightInCgroup == 0) {
+        int nice = 0;
+        for (double weight = 100; weight > limits->cpuWeight * 1.125 && nice < 19; weight /= 1.25) {
+            nice++;
+        }
+        setpriority(PRIO_PROCESS, 0, nice);
+    }
+}
+
+// Parses limit's options and shifts the command after them into place, returns -1 on an error.
+// limit [--cpus list] [--mem size] [--cpu-weight n] command [args]
+int startLimits(struct limits *limits, struct command *curr) {
+    int i = 0;
+
+    limits->hasCpus = 0;
+    limits->memory = 0;
+    limits->cpuWeight = 0;
+    for (; i + 1 < curr->numArgs && strncmp(curr->args[i], "--", 2) == 0; i += 2) {
+        char *value = curr->args[i + 1];
+        if (strcmp(curr->args[i], "--cpus") == 0 && parseCpuList(value, &limits->cpus) == 0) {
+            limits->hasCpus = 1;
+        } else if (strcmp(curr->args[i], "--mem") == 0 && parseSize(value) > 0) {
+            limits->memory = parseSize(value);
+        } else if (strcmp(curr->args[i], "--cpu-weight") == 0 && atoi(value) >= 1 && atoi(value) <= 10000) {
+            limits->cpuWeight = atoi(value);
+        } else {
+            printf("limit: bad option %s %s\n", curr->args[i], value);
+            fflush(stdout);
+            return -1;
+        }
+    }
+
+    if (i >= curr->numArgs || curr->next != NULL) {
+        printf("limit: usage: limit [--cpus list] [--mem size] [--cpu-weight n] command [args]\n");
+        fflush(stdout);
+        return -1;
+    }
+
+    curr->name = curr->args[i];
+    curr->args += i + 1;
+    curr->numArgs -= i + 1;
+    openLimitCgroup(limits);
+
+    return 0;
+}
+
+// Finishes with the limits of a command once it is launched, returns its cgroup for the job
+char *finishLimits(struct limits *limits) {
+    if (limits->cgroupProcs != -1) {
+        close(limits->cgroupProcs);
+    }
+    launchLimits = NULL;
+
+    return limits->cgroup;
+}
+
+// Appends a job's cgroup accounting to the jobs listing
+void printCgroupStats(const char *dir) {
+    long long usage = readCgroupValue(dir, "cpu.stat", "usage_usec");
+    long long memory = readCgroupValue(dir, "memory.current", NULL);
+    long long peak = readCgroupValue(dir, "memory.peak", NULL);
+
+    if (usage >= 0) {
+        printf("  cpu %.3fs", usage / 1e6);
+    }
+    if (memory >= 0) {
+        printf("  mem %.1fM", memory / 1048576.0);
+    }
+    if (peak >= 0) {
+        printf("  peak %.1fM", peak / 1048576.0);
+    }
+}
+
+// Function to execute set: set -o [option] turns an option on, set +o option turns it off
+void executeSet(struct command *curr) {
+    // set -b and set +b turn notify on and off
+    if (curr->numArgs == 1 && (strcmp(curr->args[0], "-b") == 0 || strcmp(curr->args[0], "+b") == 0)) {
+        notifyMode = curr->args[0][0] == '-';
+        return;
+    }
+
+    // With no option, list the current settings
+    if (curr->numArgs < 2) {
+        printf("splice\t%s\n", spliceMode ? "on" : "off");
+        printf("notify\t%s\n", notifyMode ? "on" : "off");
+        printf("foreground\t%s\n", activated ? "on" : "off");
+        if (reportTime >= 0) {
+            printf("reporttime\t%g\n", reportTime);
+        } else {
+            printf("reporttime\toff\n");
+        }
+        printf("shutdowngrace\t%g\n", shutdownGrace);
+        fflush(stdout);
+        return;
+    }
+
+    int value;
+    if (strcmp(curr->args[0], "-o") == 0) {
+        value = 1;
+    } else if (strcmp(curr->args[0], "+o") == 0) {
+        value = 0;
+    } else {
+        printf("set: usage: set [-b|+b] [-o|+o option]\n");
+        fflush(stdout);
+        return;
+    }
+
+    if (strcmp(curr->args[1], "splice") == 0) {
+        spliceMode = value;
+    } else if (strcmp(curr->args[1], "notify") == 0) {
+        notifyMode = value;
+    } else if (strcmp(curr->args[1], "foreground") == 0) {
+        // set -o foreground ignores &, ctrl-Z stops jobs instead of toggling it
+        setForegroundOnly(value);
+    } else if (strcmp(curr->args[1], "reporttime") == 0) {
+        // set -o reporttime [seconds] reports every command that runs at least that long
+        reportTime = value == 0 ? -1 : (curr->numArgs > 2 ? atof(curr->args[2]) : 0);
+    } else if (strcmp(curr->args[1], "shutdowngrace") == 0) {
+        // set -o shutdowngrace seconds is how long exit waits before SIGKILL, +o does not wait
+        shutdownGrace = value == 0 ? 0 : (curr->numArgs > 2 ? atof(curr->args[2]) : 2);
+    } else {
+        printf("set: %s: invalid option name\n", curr->args[1]);
+        fflush(stdout);
+    }
+}
+
+// A named in-memory buffer, filled by > @name and read by < @name
+struct capture {
+    char *name;
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+// Each buffer is allocated on its own, so a pending capture keeps pointing at it while more
+// buffers are created
+struct capture **captures = NULL;
+int numCaptures = 0;
+int captureCapacity = 0;
+
+// A pipe the shell reads into a buffer while the command runs
+struct captureTarget {
+    int fd; // Read end of the pipe
+    struct capture *buffer;
+};
+
+// Captures opened for the command being launched, read by readCaptures
+#define MAX_CAPTURES 8
+struct captureTarget pendingCaptures[MAX_CAPTURES];
+int numPendingCaptures = 0;
+
+// Returns the buffer with a name, creating it if create is 1
+struct capture *findCapture(const char *name, int create) {
+    for (int i = 0; i < numCaptures; i++) {
+        if (strcmp(captures[i]->name, name) == 0) {
+            return captures[i];
+        }
+    }
+    if (create == 0) {
+        return NULL;
+    }
+
+    if (numCaptures == captureCapacity) {
+        captureCapacity = captureCapacity == 0 ? 8 : captureCapacity * 2;
+        captures = realloc(captures, captureCapacity * sizeof(struct capture *));
+    }
+    struct capture *new = malloc(sizeof(struct capture));
+    captures[numCaptures++] = new;
+    new->name = strdup(name);
+    new->data = NULL;
+    new->length = new->capacity = 0;
+
+    return new;
+}
+
+// Appends bytes to a buffer, growing it by doubling
+void appendCapture(struct capture *buffer, const char *bytes, size_t length) {
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = buffer->capacity == 0 ? 4096 : buffer->capacity;
+        while (capacity < buffer->length + length) {
+            capacity *= 2;
+        }
+        buffer->data = realloc(buffer->data, capacity);
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->length, bytes, length);
+    buffer->length += length;
+}
+
+// Returns the write end of a pipe that readCaptures empties into the buffer, or -1
+int captureInto(struct capture *buffer) {
+    int ends[2];
+
+    if (numPendingCaptures == MAX_CAPTURES) {
+        printf("Too many captures in one command\n");
+        fflush(stdout);
+        return -1;
+    }
+    if (pipe2(ends, O_CLOEXEC) == -1) {
+        perror("Failed to create capture pipe");
+        fflush(stdout);
+        return -1;
+    }
+
+    struct captureTarget *target = &pendingCaptures[numPendingCaptures++];
+    target->fd = ends[0];
+    target->buffer = buffer;
+
+    return ends[1];
+}
+
+// Opens > @name, returns the write end of a pipe the shell reads into the buffer, or -1
+int redirectCapture(char *name, int append) {
+    struct capture *buffer = findCapture(name, 1);
+
+    if (append == 0) {
+        buffer->length = 0;
+    }
+
+    return captureInto(buffer);
+}
+
+// Opens < @name as a memfd holding the buffer, so the command can read it at its own pace
+int redirectBuffer(char *name) {
+    struct capture *buffer = findCapture(name, 0);
+    if (buffer == NULL) {
+        printf("%s: no such buffer\n", name);
+        fflush(stdout);
+        return -1;
+    }
+
+    int fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd == -1) {
+        perror("Failed to create buffer file");
+        fflush(stdout);
+        return -1;
+    }
+    for (size_t done = 0; done < buffer->length; ) {
+        ssize_t written = write(fd, buffer->data + done, buffer->length - done);
+        if (written <= 0) {
+            perror("Failed to fill buffer file");
+            fflush(stdout);
+            close(fd);
+            return -1;
+        }
+        done += written;
+    }
+    lseek(fd, 0, SEEK_SET);
+
+    return fd;
+}
+
+// io_uring set up with raw system calls, kept for the life of the shell
+#define URING_ENTRIES 8 // One read in flight per capture
+#define URING_BUFFER_SIZE 65536
+struct uring {
+    int fd; // -1 if io_uring is not available
+    int tried; // 1 once setup was attempted
+    int fixed; // 1 if the buffers are registered, so reads use IORING_OP_READ_FIXED
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    char *buffers; // URING_ENTRIES buffers of URING_BUFFER_SIZE bytes
+};
+
+struct uring uring = { -1, 0, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL };
+
+// Sets up the ring and registers its buffers, returns -1 if the kernel does not allow io_uring
+int setupUring(void) {
+    struct io_uring_params params;
+
+    if (uring.tried == 1) {
+        return uring.fd == -1 ? -1 : 0;
+    }
+    uring.tried = 1;
+
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd == -1) {
+        return -1;
+    }
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+    }
+
+    char *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    uring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    uring.buffers = mmap(NULL, URING_ENTRIES * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || uring.sqes == MAP_FAILED || uring.buffers == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    uring.sqHead = (unsigned *)(sq + params.sq_off.head);
+    uring.sqTail = (unsigned *)(sq + params.sq_off.tail);
+    uring.sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    uring.sqArray = (unsigned *)(sq + params.sq_off.array);
+    uring.cqHead = (unsigned *)(cq + params.cq_off.head);
+    uring.cqTail = (unsigned *)(cq + params.cq_off.tail);
+    uring.cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Registered buffers are pinned once instead of on every read, plain reads work without them
+    struct iovec iov[URING_ENTRIES];
+    for (int i = 0; i < URING_ENTRIES; i++) {
+        iov[i].iov_base = uring.buffers + i * URING_BUFFER_SIZE;
+        iov[i].iov_len = URING_BUFFER_SIZE;
+    }
+    uring.fixed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, URING_ENTRIES) == 0;
+    uring.fd = fd;
+
+    return 0;
+}
+
+// Queues a read of a capture pipe into its buffer, submitted with the rest of the batch
+void queueUringRead(int index) {
+    unsigned tail = *uring.sqTail;
+    unsigned slot = tail & *uring.sqMask;
+    struct io_uring_sqe *sqe = &uring.sqes[slot];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = uring.fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = pendingCaptures[index].fd;
+    sqe->addr = (unsigned long)(uring.buffers + index * URING_BUFFER_SIZE);
+    sqe->len = URING_BUFFER_SIZE;
+    sqe->off = -1;
+    sqe->buf_index = index;
+    sqe->user_data = index;
+
+    uring.sqArray[slot] = slot;
+    __atomic_store_n(uring.sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Reads every pending capture to end of file through io_uring. All reads that are ready
+// go in with one io_uring_enter, which also waits for the next completion.
+int readCapturesUring(void) {
+    int open = numPendingCaptures;
+    int queued = 0;
+
+    for (int i = 0; i < numPendingCaptures; i++) {
+        queueUringRead(i);
+        queued++;
+    }
+
+    while (open > 0) {
+        int result = syscall(__NR_io_uring_enter, uring.fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (result == -1 && errno != EINTR) {
+            return -1;
+        }
+        queued = result > 0 ? queued - result : queued;
+
+        unsigned head = *uring.cqHead;
+        unsigned tail = __atomic_load_n(uring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cqMask];
+            int index = cqe->user_data;
+
+            if (cqe->res > 0) {
+                appendCapture(pendingCaptures[index].buffer, uring.buffers + index * URING_BUFFER_SIZE, cqe->res);
+            }
+            if (cqe->res > 0 || cqe->res == -EINTR || cqe->res == -EAGAIN) {
+                queueUringRead(index);
+                queued++;
+            } else {
+                open--;
+            }
+        }
+        __atomic_store_n(uring.cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+// Reads every pending capture to end of file with epoll, for kernels without io_uring
+int readCapturesEpoll(void) {
+    char buf[URING_BUFFER_SIZE];
+    struct epoll_event events[MAX_CAPTURES];
+    int open = numPendingCaptures;
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        return -1;
+    }
+    for (int i = 0; i < numPendingCaptures; i++) {
+        struct epoll_event event = { EPOLLIN, { .u32 = i } };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, pendingCaptures[i].fd, &event);
+    }
+
+    while (open > 0) {
+        int ready = epoll_wait(epfd, events, MAX_CAPTURES, -1);
+        if (ready == -1 && errno != EINTR) {
+            break;
+        }
+        for (int i = 0; i < ready; i++) {
+            struct captureTarget *target = &pendingCaptures[events[i].data.u32];
+            ssize_t length = read(target->fd, buf, sizeof(buf));
+            if (length > 0) {
+                appendCapture(target->buffer, buf, length);
+            } else if (length == 0 || errno != EINTR) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, target->fd, NULL);
+                open--;
+            }
+        }
+    }
+    close(epfd);
+
+    return open == 0 ? 0 : -1;
+}
+
+// Reads the captures of the command just launched until it closes them, then closes the pipes
+void readCaptures(void) {
+    if (numPendingCaptures == 0) {
+        return;
+    }
+
+    if (setupUring() == -1 || readCapturesUring() == -1) {
+        readCapturesEpoll();
+    }
+
+    for (int i = 0; i < numPendingCaptures; i++) {
+        close(pendingCaptures[i].fd);
+    }
+    numPendingCaptures = 0;
+}
+
+// Function to execute buffers: buffers lists them, buffers name prints one, buffers -d name deletes it
+void executeBuffers(struct command *curr) {
+    if (curr->numArgs == 0) {
+        for (int i = 0; i < numCaptures; i++) {
+            printf("@%s\t%zu bytes\n", captures[i]->name, captures[i]->length);
+        }
+        fflush(stdout);
+        return;
+    }
+
+    int delete = strcmp(curr->args[0], "-d") == 0;
+    char *name = delete ? (curr->numArgs > 1 ? curr->args[1] : "") : curr->args[0];
+    struct capture *buffer = findCapture(name[0] == '@' ? name + 1 : name, 0);
+    if (buffer == NULL) {
+        printf("buffers: %s: no such buffer\n", name);
+        fflush(stdout);
+        return;
+    }
+
+    if (delete == 1) {
+        for (int i = 0; i < numCaptures; i++) {
+            if (captures[i] == buffer) {
+                captures[i] = captures[--numCaptures];
+                break;
+            }
+        }
+        free(buffer->name);
+        free(buffer->data);
+        free(buffer);
+    } else {
+        fflush(stdout);
+        for (size_t done = 0; done < buffer->length; ) {
+            ssize_t written = write(STDOUT_FILENO, buffer->data + done, buffer->length - done);
+            if (written <= 0) {
+                break;
+            }
+            done += written;
+        }
+    }
+}
+
+// Function to open a redirected input file, returns the fd or -1
+int redirectInput(char *input) {
+    // Open the input file, close-on-exec so only the dup'd copy reaches the child
+    int fd = open(input, O_RDONLY | O_CLOEXEC);
+
+    // Check if the open failed
+    if (fd == -1) {
+        perror("Failed to open file");
+        fflush(stdout);
+        return -1;
+    }
+
+    // Return its status
+    return fd;
+}
+
+// Function to open a redirected output file, returns the fd or -1
+int redirectOutput(char *output, int append) {
+    // Open the output file, close-on-exec so only the dup'd copy reaches the child
+    int fd = open(output, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC) | O_CLOEXEC, 0644);
+
+    // Check if the open failed
+    if (fd == -1) {
+        perror("Failed to open file");
+        fflush(stdout);
+        return -1;
+    }
+
+    // Return its status
+    return fd;
+}
+
+// Returns a shared fd for /dev/null, opened once for all background commands
+int devNull(void) {
+    static int fd = -1;
+
+    if (fd == -1) {
+        fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+        if (fd == -1) {
+            perror("Failed to open /dev/null");
+            fflush(stdout);
+        }
+    }
+
+    return fd;
+}
+
+// Duplicates an fd for the parent's use only, the child gets it through dup2
+int dupCloexec(int fd) {
+    return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+// Closes the parent's copies of the redirection fds
+void closeRedirections(int fds[3]) {
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+}
+
+// Opens the stdin/stdout/stderr a command should get in fds, -1 in a slot means inherit the shell's.
+// pipeIn/pipeOut are the pipeline ends used when the command has no explicit redirection.
+int openRedirections(struct command *curr, int pipeIn, int pipeOut, int fds[3]) {
+    fds[0] = fds[1] = fds[2] = -1;
+
+    // The shell can only fill a buffer while it waits for the command
+    int capture = (curr->output != NULL && curr->output[0] == '@') || (curr->errput != NULL && curr->errput[0] == '@');
+    if (capture == 1 && ((curr->ampersand == 1 && activated == 0) || parallelRun != NULL)) {
+        printf("Capture needs a foreground command\n");
+        fflush(stdout);
+        return -1;
+    }
+
+    // Redirect the input, < @name reads a buffer
+    if (curr->input != NULL) {
+        fds[0] = curr->input[0] == '@' ? redirectBuffer(curr->input + 1) : redirectInput(curr->input);
+        if (fds[0] == -1) {
+            return -1;
+        }
+    } else if (pipeIn != -1) {
+        fds[0] = dupCloexec(pipeIn);
+    }
+
+    // Redirect the output, > @name captures it in a buffer
+    if (curr->output != NULL) {
+        fds[1] = curr->output[0] == '@' ? redirectCapture(curr->output + 1, curr->appendOutput)
+                                        : redirectOutput(curr->output, curr->appendOutput);
+        if (fds[1] == -1) {
+            closeRedirections(fds);
+            return -1;
+        }
+    } else if (pipeOut != -1) {
+        fds[1] = dupCloexec(pipeOut);
+    } else if (curr->capture != NULL) {
+        fds[1] = captureInto(curr->capture);
+        if (fds[1] == -1) {
+            closeRedirections(fds);
+            return -1;
+        }
+    }
+
+    // Background processes read from and write to /dev/null unless told otherwise
+    if (curr->ampersand == 1) {
+        if (fds[0] == -1 && devNull() != -1) {
+            fds[0] = dupCloexec(devNull());
+        }
+        if (fds[1] == -1 && devNull() != -1) {
+            fds[1] = dupCloexec(devNull());
+        }
+    }
+
+    // Redirect the errors, 2>&1 follows stdout to wherever it ended up
+    if (curr->errput != NULL) {
+        fds[2] = curr->errput[0] == '@' ? redirectCapture(curr->errput + 1, curr->appendError)
+                                        : redirectOutput(curr->errput, curr->appendError);
+        if (fds[2] == -1) {
+            closeRedirections(fds);
+            return -1;
+        }
+    } else if (curr->errorToOutput == 1) {
+        fds[2] = dupCloexec(fds[1] != -1 ? fds[1] : STDOUT_FILENO);
+    }
+
+    return 0;
+}
+
+// Launches a command with posix_spawn, returns 0 or an errno value.
+// pgid is -1 to stay in the shell's process group, 0 to lead a new one, or the group to join.
+int launchSpawn(const char *path, char **argv, int fds[3], pid_t pgid, int takeTerminal, pid_t *pid) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    int result;
+
+    // The dup2 actions replace the dup2 calls the forked child used to make
+    posix_spawn_file_actions_init(&actions);
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] != -1) {
+            posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+        }
+    }
+#if __GLIBC_PREREQ(2, 35)
+    // Hand the terminal over before exec so the child never reads it from the background
+    if (takeTerminal == 1) {
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+    }
+#endif
+
+    // Start with the shell's original mask and the job control signals back to their defaults
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &shellMask);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    if (pgid != -1) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, pgid);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    result = posix_spawn(pid, path, &actions, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    return result;
+}
+
+// Launches a command with fork and exec, returns 0 or an errno value
+int launchFork(const char *path, char **argv, int fds[3], pid_t pgid, int takeTerminal, pid_t *pid) {
+    pid_t spawnPid = fork();
+
+    if (spawnPid == -1) {
+        return errno;
+    } else if (spawnPid == 0) {
+        // Child
+        if (pgid != -1) {
+            setpgid(0, pgid);
+            if (takeTerminal == 1) {
+                tcsetpgrp(STDIN_FILENO, getpgrp());
+            }
+        }
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &shellMask, NULL);
+        if (launchLimits != NULL) {
+            applyLimits(launchLimits);
+        }
+
+        for (int i = 0; i < 3; i++) {
+            if (fds[i] != -1 && dup2(fds[i], i) == -1) {
+                perror(i == 0 ? "Failed to redirect input" : "Failed to redirect output");
+                fflush(stdout);
+                _exit(1);
+            }
+        }
+
+        execv(path, argv);
+
+        // If execv returns, there was an error
+        perror("execvp failed");
+        fflush(stdout);
+        _exit(1);
+    }
+
+    *pid = spawnPid;
+    return 0;
+}
+
+// A fresh copy of the shell, already exec'd and linked, waiting for a command. An external
+// command is still exec'd and linked by the worker, so the pool only takes the fork or spawn
+// off the shell's path. A native builtin runs in the worker itself with no exec at all.
+struct poolWorker {
+    pid_t pid;
+    int sock; // The shell's end of the worker's socket
+};
+
+// What the shell sends a worker, followed by the path and arguments and carrying the fds
+struct poolRequest {
+    int argc;
+    int envc;
+    int size; // Bytes of NUL-terminated strings that follow: the path, argv, then the environment
+    pid_t pgid;
+    int takeTerminal;
+    int builtin; // 1 if the worker runs the command as a native builtin instead of exec'ing it
+    int hasFd[3]; // Which of stdin, stdout and stderr are passed, the cwd always is
+};
+
+int isNativeBuiltin(const char *name);
+int runWorkerBuiltin(int argc, char **argv);
+
+#define POOL_MAX_WORKERS 64
+#define POOL_MAX_REQUEST 65536
+struct pool {
+    struct poolWorker workers[POOL_MAX_WORKERS]; // Idle workers
+    int numIdle;
+    int size; // Workers to keep warm, 0 if the pool is off
+    char **allowed; // Commands the pool runs, NULL for every command
+    int numAllowed;
+    long dispatched; // Commands run by a worker
+    long cold; // Allowed commands that found no idle worker
+};
+
+struct pool pool = { .size = 0 };
+
+// Runs in a worker started as smallsh --pool-worker with its socket on fd 3: waits for a
+// request, then sets the process up like launchFork and execs or runs the builtin
+int runPoolWorker(int sock) {
+    char strings[POOL_MAX_REQUEST];
+    struct poolRequest request;
+    int fds[4];
+    char control[CMSG_SPACE(sizeof(fds))];
+
+    // The shell started the worker with the mask its commands get
+    sigprocmask(SIG_BLOCK, NULL, &shellMask);
+
+    // dup2 left the socket open across exec, it has to close there to tell the shell it worked
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+    struct iovec iov[2] = { { &request, sizeof(request) }, { strings, sizeof(strings) } };
+    struct msghdr message = { NULL, 0, iov, 2, control, sizeof(control), 0 };
+    ssize_t length = recvmsg(sock, &message, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    if (length < (ssize_t)sizeof(request) || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+        _exit(0);
+    }
+    memcpy(fds, CMSG_DATA(cmsg), cmsg->cmsg_len - CMSG_LEN(0));
+
+    // Rebuild argv and the environment from the strings, the path comes first
+    char *argv[request.argc + 1];
+    char *envp[request.envc + 1];
+    char *next = strings + strlen(strings) + 1;
+    for (int i = 0; i < request.argc; i++) {
+        argv[i] = next;
+        next += strlen(next) + 1;
+    }
+    argv[request.argc] = NULL;
+    for (int i = 0; i < request.envc; i++) {
+        envp[i] = next;
+        next += strlen(next) + 1;
+    }
+    envp[request.envc] = NULL;
+
+    if (request.pgid != -1) {
+        setpgid(0, request.pgid);
+        if (request.takeTerminal == 1) {
+            tcsetpgrp(STDIN_FILENO, getpgrp());
+        }
+    }
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &shellMask, NULL);
+
+    // The first fd is the shell's cwd, which may have changed since the worker was forked
+    int passed = 1;
+    int result = fchdir(fds[0]) == -1 ? errno : 0;
+    for (int i = 0; i < 3 && result == 0; i++) {
+        if (request.hasFd[i] == 1 && dup2(fds[passed++], i) == -1) {
+            result = errno;
+        }
+    }
+
+    // Closing the socket tells the shell the builtin started, as a successful exec would
+    if (result == 0 && request.builtin == 1) {
+        close(sock);
+        environ = envp;
+        _exit(runWorkerBuiltin(request.argc, argv));
+    }
+    if (result == 0) {
+        execve(strings, argv, envp);
+        result = errno;
+    }
+
+    // The socket closes on a successful exec, otherwise the shell is told why it failed
+    send(sock, &result, sizeof(result), MSG_NOSIGNAL);
+    _exit(1);
+}
+
+// Starts workers until the pool has its size of idle ones, the shell calls it when it is idle.
+// A worker is a new exec of the shell rather than a fork, so it is small and quick to replace.
+void refillPool(void) {
+    char self[] = "/proc/self/exe";
+    char flag[] = "--pool-worker";
+    char *argv[] = { self, flag, NULL };
+
+    while (pool.size > 0 && pool.numIdle < pool.size) {
+        int ends[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ends) == -1) {
+            return;
+        }
+
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        pid_t pid;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, ends[1], 3);
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setsigmask(&attr, &shellMask);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+        int result = posix_spawn(&pid, self, &actions, &attr, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+
+        close(ends[1]);
+        if (result != 0) {
+            close(ends[0]);
+            return;
+        }
+
+        pool.workers[pool.numIdle].pid = pid;
+        pool.workers[pool.numIdle].sock = ends[0];
+        pool.numIdle++;
+    }
+}
+
+// Closes every idle worker's socket, which makes it exit
+void stopPool(void) {
+    for (int i = 0; i < pool.numIdle; i++) {
+        trackChild(pool.workers[i].pid);
+        close(pool.workers[i].sock);
+    }
+    pool.numIdle = 0;
+    pool.size = 0;
+}
+
+// Returns 1 if the pool is on and runs the named command
+int poolAllows(const char *name) {
+    if (pool.size == 0) {
+        return 0;
+    }
+    if (pool.allowed == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < pool.numAllowed; i++) {
+        if (strcmp(pool.allowed[i], name) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Appends a string and its NUL to a pool request, returns -1 if it does not fit
+int packString(char *strings, size_t *size, const char *string) {
+    size_t length = strlen(string) + 1;
+
+    if (*size + length > POOL_MAX_REQUEST) {
+        return -1;
+    }
+    memcpy(strings + *size, string, length);
+    *size += length;
+    return 0;
+}
+
+// Hands a command to an idle worker, returns EAGAIN if there is none so another engine is used
+int launchPool(const char *path, char **argv, int fds[3], pid_t pgid, int takeTerminal, pid_t *pid) {
+    char strings[POOL_MAX_REQUEST];
+    struct poolRequest request;
+    int passed[4];
+    int numPassed = 0;
+    char control[CMSG_SPACE(sizeof(passed))];
+
+    // Pack the path, the arguments and the shell's environment as it is now, since the worker's
+    // is the one it was started with
+    size_t size = 0;
+    if (packString(strings, &size, path) == -1) {
+        return EAGAIN;
+    }
+    for (request.argc = 0; argv[request.argc] != NULL; request.argc++) {
+        if (packString(strings, &size, argv[request.argc]) == -1) {
+            return EAGAIN;
+        }
+    }
+    for (request.envc = 0; environ[request.envc] != NULL; request.envc++) {
+        if (packString(strings, &size, environ[request.envc]) == -1) {
+            return EAGAIN;
+        }
+    }
+    request.size = size;
+    request.pgid = pgid;
+    request.takeTerminal = takeTerminal;
+    request.builtin = isNativeBuiltin(argv[0]);
+
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd == -1) {
+        return EAGAIN;
+    }
+    passed[numPassed++] = cwd;
+    for (int i = 0; i < 3; i++) {
+        request.hasFd[i] = fds[i] != -1;
+        if (fds[i] != -1) {
+            passed[numPassed++] = fds[i];
+        }
+    }
+
+    struct iovec iov[2] = { { &request, sizeof(request) }, { strings, size } };
+    struct msghdr message = { NULL, 0, iov, 2, control, CMSG_SPACE(numPassed * sizeof(int)), 0 };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(numPassed * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), passed, numPassed * sizeof(int));
+
+    // Take the oldest idle worker, which has had the longest to start up. One that died is skipped.
+    int result = EAGAIN;
+    while (pool.numIdle > 0 && result == EAGAIN) {
+        struct poolWorker worker = pool.workers[0];
+        memmove(pool.workers, pool.workers + 1, --pool.numIdle * sizeof(struct poolWorker));
+        if (sendmsg(worker.sock, &message, MSG_NOSIGNAL) == -1) {
+            trackChild(worker.pid);
+            close(worker.sock);
+            continue;
+        }
+
+        // Nothing comes back if the exec worked, otherwise the reason it failed
+        int failure;
+        ssize_t length;
+        do {
+            length = recv(worker.sock, &failure, sizeof(failure), 0);
+        } while (length == -1 && errno == EINTR);
+        close(worker.sock);
+
+        result = length == sizeof(failure) ? failure : 0;
+        *pid = worker.pid;
+        if (result != 0) {
+            waitpid(worker.pid, NULL, 0);
+        }
+        pool.dispatched++;
+    }
+    close(cwd);
+
+    if (result == EAGAIN) {
+        pool.cold++;
+    }
+
+    return result;
+}
+
+// Function to execute pool: pool start [-n workers] [command ...], pool stop, or pool for its state
+void executePool(struct command *curr) {
+    if (curr->numArgs == 0) {
+        printf("pool %s: %d idle of %d, %ld dispatched, %ld cold\n", pool.size > 0 ? "on" : "off",
+               pool.numIdle, pool.size, pool.dispatched, pool.cold);
+        if (pool.allowed != NULL) {
+            printf("commands:");
+            for (int i = 0; i < pool.numAllowed; i++) {
+                printf(" %s", pool.allowed[i]);
+            }
+            printf("\n");
+        }
+        fflush(stdout);
+        return;
+    }
+
+    if (strcmp(curr->args[0], "stop") == 0) {
+        stopPool();
+        return;
+    }
+    if (strcmp(curr->args[0], "start") != 0) {
+        printf("pool: usage: pool [start [-n workers] [command ...] | stop]\n");
+        fflush(stdout);
+        return;
+    }
+
+    // Restarting replaces the old workers and command list
+    stopPool();
+    for (int i = 0; i < pool.numAllowed; i++) {
+        free(pool.allowed[i]);
+    }
+    free(pool.allowed);
+    pool.allowed = NULL;
+    pool.numAllowed = 0;
+
+    int size = 4;
+    int i = 1;
+    if (i + 1 < curr->numArgs && strcmp(curr->args[i], "-n") == 0) {
+        size = atoi(curr->args[i + 1]);
+        i += 2;
+    }
+    if (size < 1 || size > POOL_MAX_WORKERS) {
+        printf("pool: workers must be from 1 to %d\n", POOL_MAX_WORKERS);
+        fflush(stdout);
+        return;
+    }
+
+    if (i < curr->numArgs) {
+        pool.allowed = malloc((curr->numArgs - i) * sizeof(char *));
+        for (; i < curr->numArgs; i++) {
+            pool.allowed[pool.numAllowed++] = strdup(curr->args[i]);
+        }
+    }
+    pool.size = size;
+    refillPool();
+}
+
+// Launches one process with the given stdin/stdout/stderr using the current launch engine,
+// returns the pid or -1
+pid_t launchProcess(struct command *curr, int fds[3], pid_t pgid, int takeTerminal) {
+    pid_t pid = -1;
+    int result;
+
+    // Construct the argument array
+    char *argv[curr->numArgs + 2];
+    argv[0] = curr->name;
+
+    for (int i = 0; i < curr->numArgs; i++) {
+        argv[i + 1] = curr->args[i];
+    }
+
+    argv[curr->numArgs + 1] = NULL;
+
+    // Look the command up in the hash table instead of letting exec walk $PATH
+    const char *path = resolveCommand(curr->name, 0);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (path == NULL) {
+            result = ENOENT;
+            break;
+        }
+
+        // A warm worker from the pool saves the fork, and the exec too for a native builtin.
+        // EAGAIN means none was idle.
+        result = EAGAIN;
+        if (launchLimits == NULL && poolAllows(curr->name)) {
+            traceRecord(TRACE_SPAWN, 'B', 0);
+            result = launchPool(path, argv, fds, pgid, takeTerminal, &pid);
+            traceRecord(TRACE_SPAWN, 'E', pid);
+        }
+
+        // When the pool did not run it, posix_spawn avoids copying the shell's page tables. fork
+        // is only a fallback and for limited commands, which have to set themselves up between
+        // fork and exec.
+        if (result == EAGAIN && launchMode == LAUNCH_SPAWN && launchLimits == NULL) {
+            traceRecord(TRACE_SPAWN, 'B', 0);
+            result = launchSpawn(path, argv, fds, pgid, takeTerminal, &pid);
+            traceRecord(TRACE_SPAWN, 'E', pid);
+            if (result == ENOSYS) {
+                traceRecord(TRACE_FORK, 'B', 0);
+                result = launchFork(path, argv, fds, pgid, takeTerminal, &pid);
+                traceRecord(TRACE_FORK, 'E', pid);
+            }
+        } else if (result == EAGAIN) {
+            traceRecord(TRACE_FORK, 'B', 0);
+            result = launchFork(path, argv, fds, pgid, takeTerminal, &pid);
+            traceRecord(TRACE_FORK, 'E', pid);
+        }
+
+        // A remembered location that disappeared is looked up once more
+        if (result != ENOENT || path == curr->name) {
+            break;
+        }
+        path = resolveCommand(curr->name, 1);
+    }
+
+    if (result != 0) {
+        errno = result;
+        if (result == EAGAIN || result == ENOMEM) {
+            perror("Failed to fork");
+        } else {
+            perror("execvp failed");
+        }
+        fflush(stdout);
+        return -1;
+    }
+
+    // The parent joins the child to its group as well, so the group exists before the
+    // terminal is handed to it whichever process runs first
+    if (pgid != -1) {
+        setpgid(pid, pgid == 0 ? pid : pgid);
+    }
+
+    return pid;
+}
+
+// Launches a single command, pgid and takeTerminal as for launchProcess. Returns the pid or -1.
+pid_t launchCommand(struct command *curr, pid_t pgid, int takeTerminal) {
+    int fds[3];
+
+    // Open the redirections in the parent so failures are reported before launching
+    if (openRedirections(curr, -1, -1, fds) == -1) {
+        return -1;
+    }
+
+    pid_t pid = launchProcess(curr, fds, pgid, takeTerminal);
+    closeRedirections(fds);
+
+    return pid;
+}
+
+// Moves data from one pipeline stage to the next through the shell
+struct relay {
+    int from; // Read end of the upstream stage's stdout, -1 once finished
+    int to; // Write end of the downstream stage's stdin
+    int blocked; // 1 while the downstream pipe is full
+};
+
+// Moves data between stages with splice until every upstream stage closes its output.
+// Pages move pipe to pipe inside the kernel and never get copied into the shell.
+void relayPipeline(struct relay *relays, int count) {
+    struct pollfd fds[count];
+    int active = count;
+    void (*oldPipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+    while (active > 0) {
+        // Wait for data upstream, or for room downstream if the last splice filled it
+        for (int i = 0; i < count; i++) {
+            if (relays[i].from == -1) {
+                fds[i].fd = -1;
+            } else {
+                fds[i].fd = relays[i].blocked ? relays[i].to : relays[i].from;
+            }
+            fds[i].events = relays[i].blocked ? POLLOUT : POLLIN;
+            fds[i].revents = 0;
+        }
+
+        if (poll(fds, count, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to relay pipeline");
+            fflush(stdout);
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (fds[i].fd == -1 || fds[i].revents == 0) {
+                continue;
+            }
+
+            ssize_t moved = splice(relays[i].from, NULL, relays[i].to, NULL, 1 << 16,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved > 0) {
+                relays[i].blocked = 0;
+            } else if (moved == -1 && errno == EAGAIN) {
+                // Whichever side we were not waiting on is the one that stalled
+                relays[i].blocked = !relays[i].blocked;
+            } else if (moved == -1 && errno == EINTR) {
+                continue;
+            } else {
+                // End of input upstream, or the downstream stage went away
+                close(relays[i].from);
+                close(relays[i].to);
+                relays[i].from = -1;
+                active--;
+            }
+        }
+    }
+
+    // Close anything left after an error
+    for (int i = 0; i < count; i++) {
+        if (relays[i].from != -1) {
+            close(relays[i].from);
+            close(relays[i].to);
+        }
+    }
+
+    signal(SIGPIPE, oldPipe);
+}
+
+// Returns the number of stages in a pipeline
+int countStages(struct command *head) {
+    int count = 0;
+    for (struct command *stage = head; stage != NULL; stage = stage->next) {
+        count++;
+    }
+
+    return count;
+}
+
+// Launches every stage of a pipeline into one process group without waiting, or into the
+// shell's when there is no job control. pids gets one pid per stage (-1 for a stage that
+// failed), relays gets the splice relays to run when useSplice is set. Returns the process
+// group, 0 if nothing started or the stages share the shell's.
+pid_t startPipeline(struct command *head, int useTerminal, int useSplice, pid_t *pids, struct relay *relays, int *numRelays) {
+    int count = countStages(head);
+    pid_t pgid = 0;
+    int prevRead = -1;
+
+    *numRelays = 0;
+
+    int i = 0;
+    for (struct command *stage = head; stage != NULL; stage = stage->next, i++) {
+        int pipeOut = -1;
+        int nextRead = -1;
+        int fds[3];
+
+        // Connect this stage to the next one, through the shell in splice mode
+        if (stage->next != NULL) {
+            int ends[2];
+            if (pipe2(ends, O_CLOEXEC) == -1) {
+                perror("Failed to create pipe");
+                fflush(stdout);
+                pids[i] = -1;
+                break;
+            }
+            pipeOut = ends[1];
+            nextRead = ends[0];
+
+            if (useSplice == 1) {
+                int down[2];
+                if (pipe2(down, O_CLOEXEC) == 0) {
+                    relays[*numRelays].from = ends[0];
+                    relays[*numRelays].to = down[1];
+                    relays[*numRelays].blocked = 0;
+                    (*numRelays)++;
+                    nextRead = down[0];
+                }
+            }
+        }
+
+        // Launch the stage, a failed stage just closes its ends of the pipes
+        pids[i] = -1;
+        if (openRedirections(stage, prevRead, pipeOut, fds) == 0) {
+            pids[i] = launchProcess(stage, fds, jobControl == 1 ? pgid : -1, useTerminal == 1 && pgid == 0);
+            closeRedirections(fds);
+        }
+
+        if (pids[i] != -1 && pgid == 0 && jobControl == 1) {
+            pgid = pids[i];
+            if (useTerminal == 1) {
+                tcsetpgrp(STDIN_FILENO, pgid);
+            }
+        }
+
+        if (prevRead != -1) {
+            close(prevRead);
+        }
+        if (pipeOut != -1) {
+            close(pipeOut);
+        }
+        prevRead = nextRead;
+    }
+    if (prevRead != -1) {
+        close(prevRead);
+    }
+    for (i++; i < count; i++) {
+        pids[i] = -1;
+    }
+
+    return pgid;
+}
+
+// Says so when ctrl-C ended a foreground job, which also stops the loop it ran in. The
+// terminal sent SIGINT to the job's process group, so the shell only learns of it here.
+void reportInterrupt(struct process *proc) {
+    if (proc->exited == 0 && proc->exitStatus == SIGINT) {
+        interrupted = 1;
+        printf("terminated by signal %d\n", SIGINT);
+        fflush(stdout);
+    }
+}
+
+// Moves a foreground job that ctrl-Z stopped into the job table, where fg or bg resume it
+void stopForeground(struct command *curr, struct process *proc, int status) {
+    struct job *job = addJob(&jobTable, proc->pid, proc->pgid, commandText(curr), proc->started);
+
+    job->pidfd = proc->pidfd;
+    job->state = JOB_STOPPED;
+    job->exitStatus = WSTOPSIG(status);
+    job->exited = 0;
+    proc->exitStatus = WSTOPSIG(status);
+    proc->exited = 0;
+    printf("\n[%d] %d Stopped  %s\n", job->id, job->pid, job->text);
+    fflush(stdout);
+}
+
+// Function to execute a pipeline of two or more commands in one process group
+struct process *executePipeline(struct command *head) {
+    int foreground = (head->ampersand == 0 || activated == 1);
+    int useTerminal = (foreground == 1 && jobControl == 1);
+    int useSplice = (foreground == 1 && spliceMode == 1);
+    int count = countStages(head);
+    int i;
+
+    // Relaying blocks the shell, so it cannot also fill a buffer
+    for (struct command *stage = head; stage != NULL; stage = stage->next) {
+        if ((stage->output != NULL && stage->output[0] == '@') || (stage->errput != NULL && stage->errput[0] == '@')) {
+            useSplice = 0;
+        }
+    }
+
+    struct process *proc = malloc(sizeof(struct process));
+    proc->pid = -1;
+    proc->pgid = 0;
+    proc->status = 0;
+    proc->exitStatus = 1;
+    proc->exited = 1;
+    proc->started = proc->finished = monotonicSeconds();
+    memset(&proc->usage, 0, sizeof(proc->usage));
+    proc->pidfd = -1;
+
+    pid_t pids[count];
+    struct relay relays[count];
+    int numRelays = 0;
+
+    // Keep SIGCHLD from reaping stages before they are waited on below
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    pid_t pgid = startPipeline(head, useTerminal, useSplice, pids, relays, &numRelays);
+
+    proc->pid = pids[count - 1];
+    proc->pgid = pgid;
+
+    if (foreground == 1) {
+        if (numRelays > 0) {
+            relayPipeline(relays, numRelays);
+        }
+        readCaptures();
+
+        // Wait for every stage, the pipeline's status is the last stage's. Once ctrl-Z stops
+        // one stage the rest are stopped with it, so only the ones already done are reaped.
+        int stopped = 0;
+        int stopStatus = 0;
+        for (i = 0; i < count; i++) {
+            int childStatus;
+            struct rusage usage;
+            if (pids[i] == -1) {
+                continue;
+            }
+            traceRecord(TRACE_WAIT, 'B', pids[i]);
+            pid_t waited = wait4(pids[i], &childStatus, stopped == 1 ? WNOHANG | WUNTRACED : WUNTRACED, &usage);
+            traceRecord(TRACE_WAIT, 'E', pids[i]);
+            if (waited <= 0) {
+                continue;
+            }
+            if (WIFSTOPPED(childStatus)) {
+                stopped = 1;
+                stopStatus = childStatus;
+                continue;
+            }
+            pids[i] = -1;
+            addUsage(&proc->usage, &usage);
+            if (i == count - 1) {
+                proc->status = childStatus;
+                if(WIFEXITED(childStatus)) {
+                    proc->exitStatus = WEXITSTATUS(childStatus);
+                    proc->exited = 1;
+                } else {
+                    proc->exitStatus = WTERMSIG(childStatus);
+                    proc->exited = 0;
+                    reportInterrupt(proc);
+                }
+            }
+        }
+        proc->finished = monotonicSeconds();
+        if (stopped == 1) {
+            // The stages that were not reaped above are reaped with the job
+            for (i = 0; i < count - 1; i++) {
+                trackChild(pids[i]);
+            }
+            proc->pidfd = trackChild(pids[count - 1]);
+            stopForeground(head, proc, stopStatus);
+        }
+
+        // Take the terminal back
+        if (useTerminal == 1 && pgid != 0) {
+            tcsetpgrp(STDIN_FILENO, getpgrp());
+        }
+    } else if (proc->pid != -1) {
+        for (i = 0; i < count - 1; i++) {
+            trackChild(pids[i]);
+        }
+        proc->pidfd = trackChild(pids[count - 1]);
+        printf("background pid is %d\n", proc->pid);
+        fflush(stdout);
+    }
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return proc;
+}
+
+// Launches a command or pipeline and waits for it unless it runs in the background
+struct process *launchAndWait(struct command *curr) {
+    if (curr->next != NULL) {
+        return executePipeline(curr);
+    }
+
+    int foreground = (curr->ampersand == 0 || activated == 1);
+    int useTerminal = (foreground == 1 && jobControl == 1);
+    int childStatus;
+    struct process *proc = malloc(sizeof(struct process));
+    proc->pid = -1;
+    proc->pgid = 0;
+    proc->status = 0;
+    proc->exitStatus = 1;
+    proc->exited = 1;
+    proc->started = proc->finished = monotonicSeconds();
+    memset(&proc->usage, 0, sizeof(proc->usage));
+    proc->pidfd = -1;
+
+    // Keep SIGCHLD from reaping a foreground command before it is waited on below
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    // Launch the command into a process group of its own under job control, otherwise it
+    // stays in the shell's so ctrl-C reaches it. If it failed it is reported as exit value 1
+    pid_t spawnPid = launchCommand(curr, jobControl == 1 ? 0 : -1, useTerminal);
+    if (spawnPid == -1) {
+        readCaptures();
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return proc;
+    }
+
+    proc->pid = spawnPid;
+    proc->pgid = jobControl == 1 ? spawnPid : 0;
+
+    if(foreground == 1) {
+        if (useTerminal == 1) {
+            tcsetpgrp(STDIN_FILENO, spawnPid);
+        }
+
+        // Output captured with > @name is read before the command is waited for
+        readCaptures();
+        traceRecord(TRACE_WAIT, 'B', spawnPid);
+        wait4(spawnPid, &childStatus, WUNTRACED, &proc->usage);
+        traceRecord(TRACE_WAIT, 'E', spawnPid);
+        proc->finished = monotonicSeconds();
+        proc->status = childStatus;
+
+        if (WIFSTOPPED(childStatus)) {
+            proc->pidfd = trackChild(spawnPid);
+            stopForeground(curr, proc, childStatus);
+        } else if(WIFEXITED(childStatus)) {
+            proc->exitStatus = WEXITSTATUS(childStatus);
+            proc->exited = 1;
+        } else {
+            proc->exitStatus = WTERMSIG(childStatus);
+            proc->exited = 0;
+            reportInterrupt(proc);
+        }
+
+        // Take the terminal back
+        if (useTerminal == 1) {
+            tcsetpgrp(STDIN_FILENO, getpgrp());
+        }
+    } else {
+        proc->pidfd = trackChild(spawnPid);
+        printf("background pid is %d\n", spawnPid);
+        fflush(stdout);
+    }
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return proc;
+}
+
+// Function to execute a command
+struct process *executeCommand(struct command *curr) {
+    traceRecord(TRACE_EXECUTE, 'B', 0);
+    struct process *proc = launchAndWait(curr);
+    traceRecord(TRACE_EXECUTE, 'E', proc->pid == -1 ? 0 : proc->pid);
+
+    return proc;
+}
+
+// A $(...) or `...` found in a line
+struct substitution {
+    int start; // Offsets of the whole substitution in the line
+    int end;
+    int quoted; // 1 inside double quotes, where the output stays one word
+    char *text; // The command inside
+    char *output; // What it printed, trailing newlines removed
+};
+
+// Output buffers for substitutions, grown once and reused by every line
+struct capture substBuffers[MAX_CAPTURES];
+
+// Returns the offset just past the ) that closes a $( at start, or -1 if there is none
+int matchParen(const char *line, int start) {
+    int depth = 1;
+    int i = start + 2;
+
+    while (line[i] != '\0') {
+        char c = line[i++];
+        if (c == '\\' && line[i] != '\0') {
+            i++;
+        } else if (c == '\'') {
+            while (line[i] != '\0' && line[i] != '\'') {
+                i++;
+            }
+            i += line[i] != '\0';
+        } else if (c == '"') {
+            while (line[i] != '\0' && line[i] != '"') {
+                i += line[i] == '\\' && line[i + 1] != '\0' ? 2 : 1;
+            }
+            i += line[i] != '\0';
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')' && --depth == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Finds the substitutions in a line, skipping single quotes and escapes. A # at the start of
+// a word ends the scan like it ends the line in the lexer. Returns how many were found, or -1
+// after reporting an unterminated one.
+int findSubstitutions(struct arena *arena, const char *line, struct substitution **found) {
+    int count = 0;
+    int capacity = 4;
+    int quoted = 0;
+    int between = 1; // 1 if the next character starts a word
+    *found = arenaAlloc(arena, capacity * sizeof(struct substitution));
+
+    for (int i = 0; line[i] != '\0'; ) {
+        char c = line[i];
+        int end = -1;
+
+        if (c == '#' && between == 1) {
+            break;
+        }
+        between = quoted == 0 && strchr(" \t\r\n|&<>;", c) != NULL;
+
+        if (c == '\\' && line[i + 1] != '\0') {
+            i += 2;
+            continue;
+        } else if (c == '\'' && quoted == 0) {
+            const char *close = strchr(line + i + 1, '\'');
+            i = close == NULL ? (int)strlen(line) : close - line + 1;
+            continue;
+        } else if (c == '"') {
+            quoted = !quoted;
+            i++;
+            continue;
+        } else if (c == '$' && line[i + 1] == '(') {
+            end = matchParen(line, i);
+            if (end == -1) {
+                printf("unexpected end of line while looking for matching )\n");
+                fflush(stdout);
+                return -1;
+            }
+        } else if (c == '`') {
+            end = i + 1;
+            while (line[end] != '\0' && line[end] != '`') {
+                end += line[end] == '\\' && line[end + 1] != '\0' ? 2 : 1;
+            }
+            if (line[end] == '\0') {
+                printf("unexpected end of line while looking for matching `\n");
+                fflush(stdout);
+                return -1;
+            }
+            end++;
+        } else {
+            i++;
+            continue;
+        }
+
+        if (count == capacity) {
+            struct substitution *grown = arenaAlloc(arena, capacity * 2 * sizeof(struct substitution));
+            memcpy(grown, *found, count * sizeof(struct substitution));
+            *found = grown;
+            capacity *= 2;
+        }
+
+        // The command is copied out, a backquoted one loses the escapes on its backquotes
+        struct substitution *curr = &(*found)[count++];
+        int inner = c == '`' ? 1 : 2;
+        int length = end - i - inner - 1;
+        curr->start = i;
+        curr->end = end;
+        curr->quoted = quoted;
+        curr->text = arenaAlloc(arena, length + 1);
+        int out = 0;
+        for (int j = i + inner; j < end - 1; j++) {
+            if (c == '`' && line[j] == '\\' && line[j + 1] == '`') {
+                j++;
+            }
+            curr->text[out++] = line[j];
+        }
+        curr->text[out] = '\0';
+        curr->output = "";
+        i = end;
+    }
+
+    return count;
+}
+
+struct node *parseSubstitution(struct arena *arena, char *text);
+int isSinglePipeline(struct node *list);
+struct command *nodeCommand(struct arena *arena, struct node *node);
+pid_t startSubshell(struct node *list, int in, int out);
+
+// Runs a batch of substitutions at the same time. Each one is launched with its output going to
+// its own buffer, then the buffers are read together and every command is waited for.
+void runSubstitutions(struct arena *arena, struct substitution *batch, int count) {
+    struct command *commands[MAX_CAPTURES];
+    struct node *lists[MAX_CAPTURES];
+    pid_t pids[MAX_CAPTURES * 16];
+    int numPids = 0;
+
+    // Parse and expand every command first, nested substitutions in a single pipeline run here
+    // and leave the buffers free. Any other list runs in a subshell.
+    for (int i = 0; i < count; i++) {
+        lists[i] = parseSubstitution(arena, batch[i].text);
+        commands[i] = NULL;
+        if (lists[i] != NULL && isSinglePipeline(lists[i])) {
+            commands[i] = nodeCommand(arena, lists[i]);
+            if (commands[i] != NULL) {
+                expandVariables(arena, commands[i]);
+            }
+            lists[i] = NULL;
+        }
+    }
+
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    for (int i = 0; i < count; i++) {
+        substBuffers[i].length = 0;
+        if (lists[i] != NULL) {
+            int out = captureInto(&substBuffers[i]);
+            if (out != -1) {
+                pids[numPids] = startSubshell(lists[i], -1, out);
+                numPids += pids[numPids] != -1;
+                close(out);
+            }
+            continue;
+        }
+        if (commands[i] == NULL) {
+            continue;
+        }
+
+        struct command *last = commands[i];
+        while (last->next != NULL) {
+            last = last->next;
+        }
+        last->capture = &substBuffers[i];
+
+        int stages = countStages(commands[i]);
+        if (stages == 1) {
+            pids[numPids] = launchCommand(commands[i], -1, 0);
+            numPids += pids[numPids] != -1;
+        } else if (numPids + stages <= MAX_CAPTURES * 16) {
+            struct relay relays[stages];
+            int numRelays;
+            startPipeline(commands[i], 0, 0, pids + numPids, relays, &numRelays);
+            numPids += stages;
+        }
+    }
+
+    readCaptures();
+    for (int i = 0; i < numPids; i++) {
+        if (pids[i] != -1) {
+            waitpid(pids[i], NULL, 0);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    // Keep the output, the buffers are reused by the next batch
+    for (int i = 0; i < count; i++) {
+        struct capture *buffer = &substBuffers[i];
+        while (buffer->length > 0 && buffer->data[buffer->length - 1] == '\n') {
+            buffer->length--;
+        }
+        batch[i].output = arenaAlloc(arena, buffer->length + 1);
+        if (buffer->length > 0) {
+            memcpy(batch[i].output, buffer->data, buffer->length);
+        }
+        batch[i].output[buffer->length] = '\0';
+    }
+}
+
+// Writes a substitution's output into the new line so the lexer takes it literally. In double
+// quotes it stays one word, otherwise every field becomes its own single-quoted word.
+char *spliceOutput(char *out, struct substitution *curr) {
+    const char *text = curr->output;
+
+    if (curr->quoted == 1) {
+        for (; *text != '\0'; text++) {
+            if (*text == '"' || *text == '\\' || *text == '$') {
+                *out++ = '\\';
+            }
+            *out++ = *text;
+        }
+        return out;
+    }
+
+    int first = 1;
+    while (*text != '\0') {
+        text += strspn(text, " \t\n");
+        size_t length = strcspn(text, " \t\n");
+        if (length == 0) {
+            break;
+        }
+
+        if (first == 0) {
+            *out++ = ' ';
+        }
+        first = 0;
+        *out++ = '\'';
+        for (size_t i = 0; i < length; i++) {
+            if (text[i] == '\'') {
+                memcpy(out, "'\\''", 4);
+                out += 4;
+            } else {
+                *out++ = text[i];
+            }
+        }
+        *out++ = '\'';
+        text += length;
+    }
+
+    return out;
+}
+
+// Runs the command substitutions in a line and returns the line with their output in place,
+// or NULL if one is unterminated. Up to MAX_CAPTURES of them run concurrently.
+char *substituteCommands(struct arena *arena, char *line) {
+    struct substitution *found;
+    int count = findSubstitutions(arena, line, &found);
+
+    if (count <= 0) {
+        return count == 0 ? line : NULL;
+    }
+
+    for (int i = 0; i < count; i += MAX_CAPTURES) {
+        runSubstitutions(arena, found + i, count - i < MAX_CAPTURES ? count - i : MAX_CAPTURES);
+    }
+
+    // Escaping at most quadruples the output, each field adds a space and two quotes
+    size_t length = strlen(line) + 1;
+    for (int i = 0; i < count; i++) {
+        length += strlen(found[i].output) * 4 + 3;
+    }
+
+    char *result = arenaAlloc(arena, length);
+    char *out = result;
+    int from = 0;
+    for (int i = 0; i < count; i++) {
+        memcpy(out, line + from, found[i].start - from);
+        out += found[i].start - from;
+        out = spliceOutput(out, &found[i]);
+        from = found[i].end;
+    }
+    strcpy(out, line + from);
+
+    return result;
+}
+
+void freeProcess(struct process *curr) {
+    if(curr != NULL) {
+        free(curr);
+    }
+}
+
+// Makes code the status of the last foreground command, for commands that ran in the shell
+void setStatus(int code) {
+    struct process *proc = malloc(sizeof(struct process));
+    memset(proc, 0, sizeof(struct process));
+    proc->pid = -1;
+    proc->exitStatus = code;
+    proc->exited = 1;
+    freeProcess(currProc);
+    currProc = proc;
+}
+
+void freeJobTable(struct jobTable *table) {
+    for (int i = 0; i < table->count; i++) {
+        free(table->jobs[i].text);
+        removeCgroup(table->jobs[i].cgroup);
+    }
+    free(table->jobs);
+    free(table->slots);
+    table->jobs = NULL;
+    table->slots = NULL;
+    table->count = table->capacity = table->numSlots = table->usedSlots = table->numDone = 0;
+}
+
+// Collects exits, and the stops and continues of jobs tracked through pidfds. A pidfd only
+// turns readable when its process exits, so those are asked for here rather than waited on.
+void updateJobStates(struct jobTable *table) {
+    collectExits();
+
+    for (int i = 0; i < table->count && childEpoll != -1; i++) {
+        struct job *curr = &table->jobs[i];
+        siginfo_t info;
+        if (curr->state == JOB_DONE || curr->pidfd == -1) {
+            continue;
+        }
+        memset(&info, 0, sizeof(info));
+        if (waitid(P_PIDFD, curr->pidfd, &info, WSTOPPED | WCONTINUED | WNOHANG) == 0 && info.si_pid != 0) {
+            curr->state = info.si_code == CLD_CONTINUED ? JOB_RUNNING : JOB_STOPPED;
+            curr->exitStatus = info.si_status;
+            curr->exited = 0;
+        }
+    }
+}
+
+// Sends a signal to a job, to its whole process group if it has one. The group cannot be
+// reused while the job's last stage is unreaped, so a finished job is not signalled at all.
+// A job without a group is signalled through its pidfd.
+int signalJob(struct job *curr, int sig) {
+    if (curr->state == JOB_DONE) {
+        errno = ESRCH;
+        return -1;
+    }
+    if (curr->pgid > 0) {
+        return killpg(curr->pgid, sig);
+    }
+    return curr->pidfd != -1 ? sendPidfdSignal(curr->pidfd, sig) : kill(curr->pid, sig);
+}
+
+// Returns 1 if anything is left in a job's process group, reaping the shell's children in it
+int jobAlive(struct job *curr) {
+    if (curr->pgid <= 0) {
+        return waitpid(curr->pid, NULL, WNOHANG) == 0;
+    }
+    while (waitpid(-curr->pgid, NULL, WNOHANG) > 0) {
+    }
+    return killpg(curr->pgid, 0) == 0;
+}
+
+// Stops the background jobs when the shell exits. Every job's process group gets SIGTERM in
+// one pass, then the shell polls pidfds for the jobs until their groups are empty or the
+// grace period runs out, and whatever is left gets SIGKILL. The wait is bounded by that one
+// deadline however many jobs there are. Returns the number of jobs that were running.
+int shutdownJobs(struct jobTable *table, int report) {
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+    updateJobStates(table);
+
+    double start = monotonicSeconds();
+    struct pollfd *fds = malloc((table->count > 0 ? table->count : 1) * sizeof(struct pollfd));
+    struct job **pending = malloc((table->count > 0 ? table->count : 1) * sizeof(struct job *));
+    int numPending = 0;
+
+    for (int i = 0; i < table->count; i++) {
+        struct job *curr = &table->jobs[i];
+        if (curr->state == JOB_DONE) {
+            continue;
+        }
+        signalJob(curr, SIGTERM);
+
+        // A stopped job cannot act on SIGTERM until it runs again
+        if (curr->state == JOB_STOPPED) {
+            signalJob(curr, SIGCONT);
+        }
+        // A copy of the pidfd the job was tracked with, so closing it here leaves that one alone
+        pending[numPending] = curr;
+        fds[numPending].fd = curr->pidfd != -1 ? fcntl(curr->pidfd, F_DUPFD_CLOEXEC, 0) : openPidfd(curr->pid);
+        fds[numPending].events = POLLIN;
+        fds[numPending].revents = 0;
+        numPending++;
+    }
+    int total = numPending;
+
+    // A pidfd turns readable when its job's last stage exits. Jobs without one, and groups
+    // with processes left after that, are checked every 10 ms instead.
+    int exited = 0;
+    for (int pass = 0; numPending > 0; pass++) {
+        int timeout = (int)((start + shutdownGrace - monotonicSeconds()) * 1000 + 0.999);
+        for (int i = 0; i < numPending; ) {
+            if ((pass == 0 || fds[i].fd == -1 || fds[i].revents != 0) && !jobAlive(pending[i])) {
+                pending[i]->state = JOB_DONE;
+                if (fds[i].fd != -1) {
+                    close(fds[i].fd);
+                }
+                pending[i] = pending[--numPending];
+                fds[i] = fds[numPending];
+                exited++;
+                continue;
+            }
+
+            // The last stage is gone, but something else in the group is not
+            if (fds[i].revents != 0) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+            }
+            if (fds[i].fd == -1 && timeout > 10) {
+                timeout = 10;
+            }
+            i++;
+        }
+        if (numPending == 0 || monotonicSeconds() >= start + shutdownGrace) {
+            break;
+        }
+
+        for (int i = 0; i < numPending; i++) {
+            fds[i].revents = 0;
+        }
+        if (poll(fds, numPending, timeout) == -1 && errno != EINTR) {
+            break;
+        }
+    }
+
+    // Whatever outlived the grace period is killed, the kernel reparents anything still dying
+    for (int i = 0; i < numPending; i++) {
+        signalJob(pending[i], SIGKILL);
+        pending[i]->state = JOB_DONE;
+        if (fds[i].fd != -1) {
+            close(fds[i].fd);
+        }
+    }
+
+    if (report == 1 && total > 0) {
+        printf("shutdown: %d jobs, %d exited after SIGTERM, %d killed in %.3f s\n",
+               total, exited, numPending, monotonicSeconds() - start);
+        fflush(stdout);
+    }
+
+    free(fds);
+    free(pending);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return total;
+}
+
+// Function to execute exit
+void executeExit(struct jobTable *table) {
+    shutdownJobs(table, 1);
+    freeJobTable(table);
+    exit(EXIT_SUCCESS);
+}
+
+// Prints how a finished background job ended
+void reportJob(struct job *curr) {
+    if(curr->exited == 1) {
+        printf("background pid %d is done: exit value %d\n", curr->pid, curr->exitStatus);
+    } else {
+        printf("background pid %d is done: terminated by signal %d\n", curr->pid, curr->exitStatus);
+    }
+    fflush(stdout);
+}
+
+// This function remove process that have exited or been terminated
+void removeProcesses(struct jobTable *table) {
+    collectExits();
+
+    // Only walk the jobs when something actually finished
+    for (int i = table->count - 1; i >= 0 && table->numDone > 0; i--) {
+        if (table->jobs[i].state == JOB_DONE) {
+            traceRecord(TRACE_REMOVE, 'i', table->jobs[i].pid);
+            reportJob(&table->jobs[i]);
+            recordJobTiming(&table->jobs[i]);
+            removeJob(table, &table->jobs[i]);
+        }
+    }
+}
+
+// Finds the job named by %id or a pid, or the most recent job if spec is NULL
+struct job *parseJobSpec(struct jobTable *table, char *spec, char *builtin) {
+    struct job *curr = NULL;
+
+    updateJobStates(table);
+
+    if (spec == NULL) {
+        for (int i = 0; i < table->count; i++) {
+            if (curr == NULL || table->jobs[i].id > curr->id) {
+                curr = &table->jobs[i];
+            }
+        }
+    } else if (spec[0] == '%') {
+        curr = findJobId(table, atoi(spec + 1));
+    } else {
+        curr = findJob(table, atoi(spec));
+    }
+
+    if (curr == NULL) {
+        printf("%s: %s: no such job\n", builtin, spec == NULL ? "current" : spec);
+        fflush(stdout);
+    }
+
+    return curr;
+}
+
+// Blocks until a job finishes or stops, SIGCHLD must be blocked by the caller
+void waitForJob(struct job *curr) {
+    int childStatus;
+
+    if (curr->state == JOB_DONE) {
+        return;
+    }
+
+    struct process2 record;
+    if (wait4(curr->pid, &childStatus, WUNTRACED, &record.usage) == curr->pid) {
+        record.pid = curr->pid;
+        record.state = JOB_DONE;
+        record.finished = monotonicSeconds();
+        if (WIFSTOPPED(childStatus)) {
+            record.state = JOB_STOPPED;
+            record.exitStatus = WSTOPSIG(childStatus);
+            record.exited = 0;
+        } else if(WIFEXITED(childStatus)) {
+            record.exitStatus = WEXITSTATUS(childStatus);
+            record.exited = 1;
+        } else {
+            record.exitStatus = WTERMSIG(childStatus);
+            record.exited = 0;
+        }
+        recordExit(&record);
+    } else {
+        // Reaped elsewhere first, by the handler or through its pidfd
+        collectExits();
+    }
+}
+
+// Function to execute jobs
+void executeJobs(struct jobTable *table) {
+    static char *states[] = { "Running", "Stopped", "Done" };
+
+    updateJobStates(table);
+    for (int i = 0; i < table->count; i++) {
+        struct job *curr = &table->jobs[i];
+        printf("[%d] %d %-8s %s", curr->id, curr->pid, states[curr->state], curr->text);
+        if (curr->cgroup != NULL) {
+            printCgroupStats(curr->cgroup);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+// Function to execute fg: waits for a job as if it had been run in the foreground,
+// returns its status or NULL
+struct process *executeFg(struct jobTable *table, struct command *curr) {
+    sigset_t block;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, NULL);
+
+    struct job *fg = parseJobSpec(table, curr->numArgs > 0 ? curr->args[0] : NULL, "fg");
+    if (fg == NULL) {
+        sigprocmask(SIG_UNBLOCK, &block, NULL);
+        return NULL;
+    }
+
+    printf("%s\n", fg->text);
+    fflush(stdout);
+
+    int useTerminal = (fg->pgid > 0 && jobControl == 1);
+    if (useTerminal == 1) {
+        tcsetpgrp(STDIN_FILENO, fg->pgid);
+    }
+    if (fg->state == JOB_STOPPED) {
+        signalJob(fg, SIGCONT);
+        fg->state = JOB_RUNNING;
+    }
+
+    waitForJob(fg);
+    if (useTerminal == 1) {
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+
+    struct process *proc = malloc(sizeof(struct process));
+    proc->pid = fg->pid;
+    proc->pgid = fg->pgid;
+    proc->status = 0;
+    proc->exitStatus = fg->exitStatus;
+    proc->exited = fg->exited;
+    proc->started = fg->started;
+    proc->finished = fg->finished;
+    proc->usage = fg->usage;
+    proc->pidfd = fg->pidfd;
+
+    // Stopped again by ctrl-Z, it stays in the table
+    if (fg->state == JOB_STOPPED) {
+        printf("\n[%d] %d Stopped  %s\n", fg->id, fg->pid, fg->text);
+        fflush(stdout);
+        sigprocmask(SIG_UNBLOCK, &block, NULL);
+        return proc;
+    }
+    reportInterrupt(proc);
+
+    recordTiming(fg->text, proc);
+    fg->text = NULL;
+
+    removeJob(table, fg);
+    sigprocmask(SIG_UNBLOCK, &block, NULL);
+    return proc;
+}
+
+// Function to execute bg: lets a stopped job continue in the background
+void executeBg(struct jobTable *table, struct command *curr) {
+    struct job *bg = parseJobSpec(table, curr->numArgs > 0 ? curr->args[0] : NULL, "bg");
+
+    if (bg != NULL && bg->state == JOB_STOPPED) {
+        signalJob(bg, SIGCONT);
+        bg->state = JOB_RUNNING;
+        printf("[%d] %s\n", bg->id, bg->text);
+        fflush(stdout);
+    }
+}
+
+// Returns the exit code the shell reports for a finished job
+int jobExitCode(struct job *curr) {
+    return curr->exited == 1 ? curr->exitStatus : 128 + curr->exitStatus;
+}
+
+// Waits for wait -n: until one of the listed jobs, or any job if none are listed, finishes.
+// Child exits are polled for like at the prompt and collectExits does the reaping.
+// Returns the job's exit code, or 127 if nothing was left to wait for.
+int waitForAnyJob(struct jobTable *table, char **specs, int numSpecs) {
+    struct pollfd wake = { exitFd, POLLIN, 0 };
+    int ids[numSpecs > 0 ? numSpecs : 1];
+    int code = 127;
+
+    for (int i = 0; i < numSpecs; i++) {
+        struct job *listed = parseJobSpec(table, specs[i], "wait");
+        ids[i] = listed == NULL ? -1 : listed->id;
+    }
+
+    // ctrl-C gives up on the wait
+    interrupted = 0;
+    while (interrupted == 0) {
+        collectExits();
+
+        struct job *done = NULL;
+        int running = 0;
+        for (int i = 0; i < table->count && done == NULL; i++) {
+            struct job *curr = &table->jobs[i];
+            int listed = numSpecs == 0;
+            for (int j = 0; j < numSpecs && listed == 0; j++) {
+                listed = ids[j] == curr->id;
+            }
+            if (listed == 1 && curr->state == JOB_DONE) {
+                done = curr;
+            }
+            running += listed == 1 && curr->state == JOB_RUNNING;
+        }
+        if (done != NULL) {
+            code = jobExitCode(done);
+            break;
+        }
+        if (running == 0) {
+            break;
+        }
+
+        if (poll(&wake, 1, -1) == 1) {
+            drainWakePipe();
+        }
+    }
+
+    removeProcesses(table);
+    return code;
+}
+
+// Function to execute wait: waits for the named jobs, or every job, and reports them.
+// wait -n [jobs] returns as soon as one of them finishes. Returns the exit code of the
+// last job waited for.
+int executeWait(struct jobTable *table, struct command *curr) {
+    if (curr->numArgs > 0 && strcmp(curr->args[0], "-n") == 0) {
+        return waitForAnyJob(table, curr->args + 1, curr->numArgs - 1);
+    }
+
+    sigset_t block;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, NULL);
+    collectExits();
+
+    int code = 0;
+    if (curr->numArgs == 0) {
+        for (int i = 0; i < table->count; i++) {
+            if (table->jobs[i].state != JOB_STOPPED) {
+                waitForJob(&table->jobs[i]);
+            }
+        }
+    } else {
+        for (int i = 0; i < curr->numArgs; i++) {
+            struct job *waited = parseJobSpec(table, curr->args[i], "wait");
+            code = 127;
+            if (waited != NULL && waited->state != JOB_STOPPED) {
+                waitForJob(waited);
+                code = jobExitCode(waited);
+            }
+        }
+    }
+
+    sigprocmask(SIG_UNBLOCK, &block, NULL);
+    removeProcesses(table);
+    return code;
+}
+
+// Returns 1 if a line is only whitespace or a comment
+int isBlankLine(char *line) {
+    while (*line != '\0' && isspace((unsigned char)*line)) {
+        line++;
+    }
+
+    return *line == '\0' || *line == '#';
+}
+
+// Launches one command line for the parallel builtin without waiting, returns the pid to wait on
+pid_t startParallelLine(struct arena *arena, char *line) {
+    // The line is parsed like a script line, keep it intact for the report
+    char *copy = copyToken(arena, line);
+    struct node *list = parseSubstitution(arena, copy);
+    pid_t pid = -1;
+
+    if (list == NULL) {
+        return -1;
+    }
+
+    // A list or compound command runs in a subshell, its status is that of the whole line
+    if (!isSinglePipeline(list)) {
+        int in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        pid = startSubshell(list, in, -1);
+        if (in != -1) {
+            close(in);
+        }
+        trackChild(pid);
+        return pid;
+    }
+
+    struct command *curr = nodeCommand(arena, list);
+    if (curr == NULL) {
+        return -1;
+    }
+    expandVariables(arena, curr);
+
+    // Commands must not compete with the shell for its input
+    if (curr->input == NULL) {
+        curr->input = "/dev/null";
+    }
+
+    if (curr->next == NULL) {
+        pid = launchCommand(curr, -1, 0);
+        trackChild(pid);
+    } else {
+        int count = countStages(curr);
+        pid_t pids[count];
+        struct relay relays[count];
+        int numRelays;
+
+        startPipeline(curr, 0, 0, pids, relays, &numRelays);
+        pid = pids[count - 1];
+        for (int i = 0; i < count; i++) {
+            trackChild(pids[i]);
+        }
+    }
+
+    return pid;
+}
+
+// Reads every line of a reader into a growing array, skipping blank lines and comments
+char **readCommandLines(struct lineReader *reader, int *count) {
+    char **lines = NULL;
+    int capacity = 0;
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t read;
+
+    *count = 0;
+    while ((read = readLine(reader, &line, &len)) != -1) {
+        if (isBlankLine(line)) {
+            continue;
+        }
+        if (line[read - 1] == '\n') {
+            line[read - 1] = '\0';
+        }
+
+        if (*count == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            lines = realloc(lines, capacity * sizeof(char *));
+        }
+        lines[(*count)++] = strdup(line);
+    }
+    free(line);
+
+    return lines;
+}
+
+// Function to execute parallel: parallel [-j N] [file]
+// Runs the command lines in file, or the shell's input, with at most N in flight
+// and then prints each one's status. N defaults to the number of online cores.
+void executeParallel(struct command *curr) {
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    char *path = curr->input;
+
+    for (int i = 0; i < curr->numArgs; i++) {
+        if (strcmp(curr->args[i], "-j") == 0 && i + 1 < curr->numArgs) {
+            jobs = atoi(curr->args[++i]);
+        } else {
+            path = curr->args[i];
+        }
+    }
+    if (jobs <= 0) {
+        jobs = 1;
+    }
+
+    // Read the command lines
+    struct lineReader fileReader = { -1, NULL, 0, 0, 0 };
+    struct lineReader *reader = &stdinReader;
+    if (path != NULL) {
+        fileReader.fd = redirectInput(path);
+        if (fileReader.fd == -1) {
+            return;
+        }
+        reader = &fileReader;
+    }
+
+    int count;
+    char **lines = readCommandLines(reader, &count);
+    if (path != NULL) {
+        close(fileReader.fd);
+        free(fileReader.buf);
+    }
+
+    struct parallelRun run;
+    run.numSlots = jobs;
+    run.running = 0;
+    run.slots = calloc(jobs, sizeof(struct parallelSlot));
+    run.results = malloc((count > 0 ? count : 1) * sizeof(struct process2));
+    parallelRun = &run;
+
+    // Start a new line as soon as a slot frees up, exits arrive through childHandleSig
+    int next = 0;
+    while (next < count || run.running > 0) {
+        for (int i = 0; i < jobs && next < count; i++) {
+            if (run.slots[i].pid != 0) {
+                continue;
+            }
+
+            pid_t pid = startParallelLine(&lineArena, lines[next]);
+            arenaReset(&lineArena);
+            if (pid == -1) {
+                run.results[next].pid = -1;
+                run.results[next].exitStatus = 1;
+                run.results[next].exited = 1;
+            } else {
+                run.slots[i].pid = pid;
+                run.slots[i].line = next;
+                run.running++;
+            }
+            next++;
+        }
+
+        collectExits();
+        if (run.running == 0 || (run.running < jobs && next < count)) {
+            continue;
+        }
+
+        // Sleep until a child exits
+        struct pollfd fds = { exitFd, POLLIN, 0 };
+        if (poll(&fds, 1, -1) > 0) {
+            drainWakePipe();
+        }
+    }
+    parallelRun = NULL;
+
+    // Report every line in the status format, the builtin's own status counts the failures
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        struct process2 *result = &run.results[i];
+        if (result->exited == 1) {
+            printf("[%d] %s: exit value %d\n", i + 1, lines[i], result->exitStatus);
+        } else {
+            printf("[%d] %s: terminated by signal %d\n", i + 1, lines[i], result->exitStatus);
+        }
+        if (result->exited == 0 || result->exitStatus != 0) {
+            failed++;
+        }
+        free(lines[i]);
+    }
+    fflush(stdout);
+
+    freeProcess(currProc);
+    currProc = malloc(sizeof(struct process));
+    currProc->pid = -1;
+    currProc->pgid = 0;
+    currProc->status = 0;
+    currProc->exitStatus = failed > 101 ? 101 : failed;
+    currProc->exited = 1;
+    currProc->pidfd = -1;
+
+    free(lines);
+    free(run.slots);
+    free(run.results);
+}
+
+// Command history, shared by every shell through one append-only file. Lines are appended
+// under an exclusive flock so concurrent shells never interleave them. The file is mapped
+// and only indexed when a search needs it, so startup reads none of it.
+struct history {
+    int fd; // -1 if there is no history file
+    char *path;
+    char *map;
+    size_t size; // Bytes of the file in the mapping
+    size_t mapped; // Bytes mapped, up to the last complete line
+    size_t *sorted; // Offsets of the lines in the first indexed bytes, sorted by their text
+    size_t numSorted;
+    size_t capacity;
+    size_t indexed;
+    size_t counted; // Lines before the counted offset, so numbers come without a rescan
+    size_t numCounted;
+    char *last; // Line this shell added last, a repeat of it is not added again
+};
+
+struct history history = { -1, NULL, NULL, 0, 0, NULL, 0, 0, 0, 0, 0, NULL };
+
+void forgetHistoryPosition(void);
+
+// Opens $SMALLSH_HISTORY, or ~/.smallsh_history
+void openHistory(void) {
+    char path[4096];
+    const char *file = getenv("SMALLSH_HISTORY");
+
+    if (file == NULL) {
+        if (getenv("HOME") == NULL) {
+            return;
+        }
+        snprintf(path, sizeof(path), "%s/.smallsh_history", getenv("HOME"));
+        file = path;
+    }
+    history.fd = open(file, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    history.path = history.fd == -1 ? NULL : strdup(file);
+}
+
+// Forgets everything read from the history file, none of the offsets into it hold any more
+void resetHistory(void) {
+    if (history.map != NULL) {
+        munmap(history.map, history.size);
+    }
+    forgetHistoryPosition();
+    history.map = NULL;
+    history.size = history.mapped = history.indexed = history.numSorted = history.counted = history.numCounted = 0;
+}
+
+// Reopens the history file when rotation put a new file in place of the one that is open
+void followHistory(void) {
+    struct stat named;
+    struct stat info;
+
+    if (history.path != NULL && stat(history.path, &named) == 0 && fstat(history.fd, &info) == 0 &&
+        (named.st_ino != info.st_ino || named.st_dev != info.st_dev)) {
+        int fd = open(history.path, O_RDWR | O_APPEND | O_CLOEXEC);
+        if (fd != -1) {
+            close(history.fd);
+            history.fd = fd;
+            resetHistory();
+        }
+    }
+}
+
+// Appends a line to the history file, it must not contain a newline
+void addHistory(const char *line, size_t length) {
+    if (history.fd == -1 || length == 0 ||
+        (history.last != NULL && strlen(history.last) == length && memcmp(history.last, line, length) == 0)) {
+        return;
+    }
+    followHistory();
+
+    struct iovec iov[2] = { { (void *)line, length }, { "\n", 1 } };
+    flock(history.fd, LOCK_EX);
+    writev(history.fd, iov, 2);
+    flock(history.fd, LOCK_UN);
+
+    free(history.last);
+    history.last = strndup(line, length);
+}
+
+// Maps what other shells and this one have added since the last look. Returns 0 if there is
+// any history.
+int mapHistory(void) {
+    struct stat info;
+
+    if (history.fd == -1) {
+        return -1;
+    }
+    followHistory();
+
+    // A writer holds the lock for a whole line, so the size never ends inside one
+    flock(history.fd, LOCK_SH);
+    int result = fstat(history.fd, &info);
+    flock(history.fd, LOCK_UN);
+
+    // A file that shrank was truncated or rewritten, it is read again from the start
+    if (result == 0 && (size_t)info.st_size < history.mapped) {
+        resetHistory();
+    }
+    if (result == -1 || (size_t)info.st_size == history.mapped) {
+        return history.mapped > 0 ? 0 : -1;
+    }
+
+    if (history.map != NULL) {
+        munmap(history.map, history.size);
+    }
+    history.map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, history.fd, 0);
+    if (history.map == MAP_FAILED) {
+        history.map = NULL;
+        resetHistory();
+        return -1;
+    }
+    history.size = info.st_size;
+
+    // Only whole lines count, in case the file was written without the lock
+    char *end = memrchr(history.map, '\n', info.st_size);
+    history.mapped = end == NULL ? 0 : end - history.map + 1;
+    return history.mapped > 0 ? 0 : -1;
+}
+
+// Returns the number of lines from offset from to offset to
+size_t countLines(size_t from, size_t to) {
+    size_t lines = 0;
+
+    for (char *p = history.map + from; (p = memchr(p, '\n', history.map + to - p)) != NULL; p++) {
+        lines++;
+    }
+    return lines;
+}
+
+// Returns the number of the line at an offset, counting from 1
+size_t historyNumber(size_t offset) {
+    if (offset < history.counted) {
+        return countLines(0, offset) + 1;
+    }
+
+    history.numCounted += countLines(history.counted, offset);
+    history.counted = offset;
+    return history.numCounted + 1;
+}
+
+// Orders two history lines by their text, then oldest first. A line ends at its newline.
+int compareHistory(const void *a, const void *b) {
+    size_t x = *(const size_t *)a;
+    size_t y = *(const size_t *)b;
+    const unsigned char *p = (const unsigned char *)history.map + x;
+    const unsigned char *q = (const unsigned char *)history.map + y;
+
+    while (*p == *q && *p != '\n') {
+        p++;
+        q++;
+    }
+    if (*p == *q) {
+        return (x > y) - (x < y);
+    }
+    return (*p == '\n' ? 0 : *p) - (*q == '\n' ? 0 : *q);
+}
+
+// Brings the sorted index up to date. Lines added since the last time are sorted on their own
+// and merged in, so the index is only ever built once.
+int indexHistory(void) {
+    if (mapHistory() == -1) {
+        return -1;
+    }
+    if (history.indexed == history.mapped) {
+        return 0;
+    }
+
+    size_t numNew = countLines(history.indexed, history.mapped);
+    size_t *added = malloc(numNew * sizeof(size_t));
+    size_t n = 0;
+    for (size_t offset = history.indexed; offset < history.mapped; n++) {
+        added[n] = offset;
+        offset = (char *)memchr(history.map + offset, '\n', history.mapped - offset) - history.map + 1;
+    }
+    qsort(added, numNew, sizeof(size_t), compareHistory);
+
+    if (history.numSorted + numNew > history.capacity) {
+        history.capacity = (history.numSorted + numNew) * 2;
+        history.sorted = realloc(history.sorted, history.capacity * sizeof(size_t));
+    }
+
+    // Merge from the back so the new lines go straight into place
+    size_t i = history.numSorted;
+    size_t j = numNew;
+    size_t k = history.numSorted + numNew;
+    while (j > 0) {
+        if (i > 0 && compareHistory(&history.sorted[i - 1], &added[j - 1]) > 0) {
+            history.sorted[--k] = history.sorted[--i];
+        } else {
+            history.sorted[--k] = added[--j];
+        }
+    }
+    history.numSorted += numNew;
+    history.indexed = history.mapped;
+    free(added);
+
+    return 0;
+}
+
+// Returns 1 if the history line at an offset starts with prefix
+int historyHasPrefix(size_t offset, const char *prefix, size_t length) {
+    return history.mapped - offset > length && memcmp(history.map + offset, prefix, length) == 0 &&
+           memchr(history.map + offset, '\n', length) == NULL;
+}
+
+// Finds the range of sorted lines that start with prefix, returns how many there are
+size_t findHistoryPrefix(const char *prefix, size_t *first) {
+    size_t length = strlen(prefix);
+    size_t low = 0;
+    size_t high = history.numSorted;
+
+    // Lower bound: the first line whose start is not less than the prefix
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        const unsigned char *p = (const unsigned char *)history.map + history.sorted[middle];
+        size_t i = 0;
+        while (i < length && p[i] == (unsigned char)prefix[i]) {
+            i++;
+        }
+        int less = i < length && (p[i] == '\n' || p[i] < (unsigned char)prefix[i]);
+        if (less) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    *first = low;
+    size_t last = low;
+    while (last < history.numSorted && historyHasPrefix(history.sorted[last], prefix, length)) {
+        last++;
+    }
+    return last - low;
+}
+
+// Returns the offset of the newest line starting with prefix, or -1
+ssize_t newestWithPrefix(const char *prefix) {
+    size_t first;
+    ssize_t newest = -1;
+
+    if (indexHistory() == -1) {
+        return -1;
+    }
+    size_t count = findHistoryPrefix(prefix, &first);
+    for (size_t i = first; i < first + count; i++) {
+        if ((ssize_t)history.sorted[i] > newest) {
+            newest = history.sorted[i];
+        }
+    }
+
+    return newest;
+}
+
+// Returns the offset of the line with a number, or of the last line if number is 0, or -1
+ssize_t historyLine(size_t number) {
+    if (mapHistory() == -1) {
+        return -1;
+    }
+
+    if (number == 0) {
+        char *end = memrchr(history.map, '\n', history.mapped - 1);
+        return end == NULL ? 0 : end - history.map + 1;
+    }
+
+    char *p = history.map;
+    for (size_t i = 1; i < number && p != NULL; i++) {
+        p = memchr(p, '\n', history.map + history.mapped - p);
+        p = p == NULL || p + 1 == history.map + history.mapped ? NULL : p + 1;
+    }
+    return p == NULL ? -1 : p - history.map;
+}
+
+// Prints one history line with its number
+void printHistory(size_t offset) {
+    size_t length = (char *)memchr(history.map + offset, '\n', history.mapped - offset) - (history.map + offset);
+    printf("%5zu  %.*s\n", historyNumber(offset), (int)length, history.map + offset);
+}
+
+int compareOffsets(const void *a, const void *b) {
+    size_t x = *(const size_t *)a;
+    size_t y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Function to execute history: history [count], history -p prefix, or history -s text.
+// -p uses the sorted index, -s scans the mapping with memmem.
+void executeHistory(struct command *curr) {
+    if (mapHistory() == -1) {
+        return;
+    }
+
+    if (curr->numArgs == 2 && strcmp(curr->args[0], "-p") == 0) {
+        size_t first;
+        indexHistory();
+        size_t count = findHistoryPrefix(curr->args[1], &first);
+
+        // Matches are listed oldest first, like the rest of the history
+        size_t *matches = malloc((count > 0 ? count : 1) * sizeof(size_t));
+        memcpy(matches, history.sorted + first, count * sizeof(size_t));
+        qsort(matches, count, sizeof(size_t), compareOffsets);
+        for (size_t i = 0; i < count; i++) {
+            printHistory(matches[i]);
+        }
+        free(matches);
+    } else if (curr->numArgs == 2 && strcmp(curr->args[0], "-s") == 0) {
+        const char *text = curr->args[1];
+        size_t length = strlen(text);
+        char *end = history.map + history.mapped;
+        for (char *p = history.map; length > 0 && (p = memmem(p, end - p, text, length)) != NULL; ) {
+            // Back up to the start of the line and skip past its end
+            char *start = memrchr(history.map, '\n', p - history.map);
+            start = start == NULL ? history.map : start + 1;
+            if (memchr(p, '\n', length) == NULL) {
+                printHistory(start - history.map);
+            }
+            p = memchr(p, '\n', end - p) + 1;
+        }
+    } else if (curr->numArgs == 0 || (curr->numArgs == 1 && isdigit((unsigned char)curr->args[0][0]))) {
+        // The last count lines, found from the end so the rest of the file is not read
+        size_t count = curr->numArgs == 0 ? (size_t)-1 : strtoul(curr->args[0], NULL, 10);
+        size_t offset = history.mapped;
+        for (size_t i = 0; i < count && offset > 0; i++) {
+            char *start = offset < 2 ? NULL : memrchr(history.map, '\n', offset - 1);
+            offset = start == NULL ? 0 : start - history.map + 1;
+        }
+        for (char *p = history.map + offset; p < history.map + history.mapped; p = memchr(p, '\n', history.map + history.mapped - p) + 1) {
+            printHistory(p - history.map);
+        }
+    } else {
+        printf("history: usage: history [count] | -p prefix | -s text\n");
+    }
+    fflush(stdout);
+}
+
+// Replaces a line that starts with ! by the history line it names: !! is the last line, !N
+// line N, and !prefix the newest line that starts with prefix. Prints the line it ran, like
+// other shells. Returns -1 if there is no such line.
+int expandHistory(char **line, size_t *len) {
+    char *spec = *line + 1;
+    spec[strcspn(spec, " \t\r\n")] = '\0';
+    ssize_t offset;
+
+    if (strcmp(spec, "!") == 0) {
+        offset = historyLine(0);
+    } else if (isdigit((unsigned char)spec[0])) {
+        offset = historyLine(strtoul(spec, NULL, 10));
+    } else {
+        offset = newestWithPrefix(spec);
+    }
+    if (offset == -1) {
+        printf("!%s: event not found\n", spec);
+        fflush(stdout);
+        return -1;
+    }
+
+    size_t length = (char *)memchr(history.map + offset, '\n', history.mapped - offset) - (history.map + offset) + 1;
+    if (*len < length + 1) {
+        *len = length + 1;
+        *line = realloc(*line, *len);
+    }
+    memcpy(*line, history.map + offset, length);
+    (*line)[length] = '\0';
+    printf("%s", *line);
+    fflush(stdout);
+
+    return 0;
+}
+
+// Writes a string with echo -e and printf %b escapes expanded. Returns 1 if \c asked for
+// output to stop there.
+int writeEscapes(const char *text) {
+    for (; *text != '\0'; text++) {
+        if (*text != '\\' || text[1] == '\0') {
+            putchar(*text);
+            continue;
+        }
+
+        text++;
+        switch (*text) {
+        case 'a': putchar('\a'); break;
+        case 'b': putchar('\b'); break;
+        case 'e': putchar('\033'); break;
+        case 'f': putchar('\f'); break;
+        case 'n': putchar('\n'); break;
+        case 'r': putchar('\r'); break;
+        case 't': putchar('\t'); break;
+        case 'v': putchar('\v'); break;
+        case '\\': putchar('\\'); break;
+        case 'c': return 1;
+        case '0': {
+            // \0nnn is up to three octal digits
+            int value = 0;
+            for (int i = 0; i < 3 && text[1] >= '0' && text[1] <= '7'; i++) {
+                value = value * 8 + (*++text - '0');
+            }
+            putchar(value);
+            break;
+        }
+        case 'x': {
+            // \xHH is one or two hex digits, without any it stays as written
+            if (!isxdigit((unsigned char)text[1])) {
+                putchar('\\');
+                putchar('x');
+                break;
+            }
+            int value = 0;
+            for (int i = 0; i < 2 && isxdigit((unsigned char)text[1]); i++) {
+                text++;
+                value = value * 16 + (isdigit((unsigned char)*text) ? *text - '0' : tolower((unsigned char)*text) - 'a' + 10);
+            }
+            putchar(value);
+            break;
+        }
+        default:
+            putchar('\\');
+            putchar(*text);
+        }
+    }
+
+    return 0;
+}
+
+// echo [-n] [-e] [-E] [args]
+int builtinEcho(struct command *curr) {
+    int newline = 1;
+    int escapes = 0;
+    int i = 0;
+
+    // Options only count while every letter is one echo knows
+    for (; i < curr->numArgs && curr->args[i][0] == '-' && curr->args[i][1] != '\0'; i++) {
+        const char *option = curr->args[i] + 1;
+        if (option[strspn(option, "neE")] != '\0') {
+            break;
+        }
+        for (; *option != '\0'; option++) {
+            newline = *option == 'n' ? 0 : newline;
+            escapes = *option == 'e' ? 1 : (*option == 'E' ? 0 : escapes);
+        }
+    }
+
+    for (int first = i; i < curr->numArgs; i++) {
+        if (i > first) {
+            putchar(' ');
+        }
+        if (escapes == 0) {
+            fputs(curr->args[i], stdout);
+        } else if (writeEscapes(curr->args[i]) == 1) {
+            newline = 0;
+            break;
+        }
+    }
+    if (newline == 1) {
+        putchar('\n');
+    }
+    fflush(stdout);
+
+    return 0;
+}
+
+int builtinTrue(struct command *curr) {
+    (void)curr;
+    return 0;
+}
+
+int builtinFalse(struct command *curr) {
+    (void)curr;
+    return 1;
+}
+
+// Parses a test integer, sets *error if it is not one
+long long testNumber(const char *text, int *error) {
+    char *end;
+    long long value = strtoll(text, &end, 10);
+
+    while (isspace((unsigned char)*end)) {
+        end++;
+    }
+    if (end == text || *end != '\0') {
+        printf("test: %s: integer expression expected\n", text);
+        fflush(stdout);
+        *error = 1;
+    }
+
+    return value;
+}
+
+// Returns 1 if op is a unary file or string test
+int isUnaryTest(const char *op) {
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0' && strchr("nzefdrwxsLhpSbcgukGOt", op[1]) != NULL;
+}
+
+// Returns 1 if op is a binary test
+int isBinaryTest(const char *op) {
+    static const char *ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef" };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (strcmp(op, ops[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Evaluates a unary test
+int unaryTest(const char *op, const char *arg) {
+    struct stat info;
+
+    switch (op[1]) {
+    case 'n': return arg[0] != '\0';
+    case 'z': return arg[0] == '\0';
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    case 't': return isatty(atoi(arg));
+    case 'L': case 'h': return lstat(arg, &info) == 0 && S_ISLNK(info.st_mode);
+    }
+
+    if (stat(arg, &info) == -1) {
+        return 0;
+    }
+    switch (op[1]) {
+    case 'e': return 1;
+    case 'f': return S_ISREG(info.st_mode);
+    case 'd': return S_ISDIR(info.st_mode);
+    case 's': return info.st_size > 0;
+    case 'p': return S_ISFIFO(info.st_mode);
+    case 'S': return S_ISSOCK(info.st_mode);
+    case 'b': return S_ISBLK(info.st_mode);
+    case 'c': return S_ISCHR(info.st_mode);
+    case 'g': return (info.st_mode & S_ISGID) != 0;
+    case 'u': return (info.st_mode & S_ISUID) != 0;
+    case 'k': return (info.st_mode & S_ISVTX) != 0;
+    case 'G': return info.st_gid == getegid();
+    case 'O': return info.st_uid == geteuid();
+    }
+
+    return 0;
+}
+
+// Evaluates a binary test
+int binaryTest(const char *left, const char *op, const char *right, int *error) {
+    struct stat a, b;
+
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(left, right) == 0;
+    } else if (strcmp(op, "!=") == 0) {
+        return strcmp(left, right) != 0;
+    } else if (strcmp(op, "<") == 0) {
+        return strcmp(left, right) < 0;
+    } else if (strcmp(op, ">") == 0) {
+        return strcmp(left, right) > 0;
+    } else if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        int haveLeft = stat(left, &a) == 0;
+        int haveRight = stat(right, &b) == 0;
+        if (op[1] == 'e') {
+            return haveLeft && haveRight && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        }
+        if (op[1] == 'n') {
+            return haveLeft && (!haveRight || a.st_mtim.tv_sec > b.st_mtim.tv_sec ||
+                   (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec));
+        }
+        return haveRight && (!haveLeft || a.st_mtim.tv_sec < b.st_mtim.tv_sec ||
+               (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec < b.st_mtim.tv_nsec));
+    }
+
+    long long x = testNumber(left, error);
+    long long y = testNumber(right, error);
+    switch (op[1] * 256 + op[2]) {
+    case 'e' * 256 + 'q': return x == y;
+    case 'n' * 256 + 'e': return x != y;
+    case 'l' * 256 + 't': return x < y;
+    case 'l' * 256 + 'e': return x <= y;
+    case 'g' * 256 + 't': return x > y;
+    }
+    return x >= y;
+}
+
+// Recursive descent over test's arguments, *pos is the next one to read
+int testOr(char **args, int count, int *pos, int *error);
+
+int testPrimary(char **args, int count, int *pos, int *error) {
+    if (*pos >= count) {
+        printf("test: argument expected\n");
+        fflush(stdout);
+        *error = 1;
+        return 0;
+    }
+
+    char *arg = args[*pos];
+    if (strcmp(arg, "!") == 0) {
+        (*pos)++;
+        return !testPrimary(args, count, pos, error);
+    }
+    if (strcmp(arg, "(") == 0 && *pos + 1 < count) {
+        (*pos)++;
+        int value = testOr(args, count, pos, error);
+        if (*pos >= count || strcmp(args[*pos], ")") != 0) {
+            printf("test: missing )\n");
+            fflush(stdout);
+            *error = 1;
+            return 0;
+        }
+        (*pos)++;
+        return value;
+    }
+    if (*pos + 2 < count && isBinaryTest(args[*pos + 1])) {
+        *pos += 3;
+        return binaryTest(args[*pos - 3], args[*pos - 2], args[*pos - 1], error);
+    }
+    if (isUnaryTest(arg) && *pos + 1 < count) {
+        *pos += 2;
+        return unaryTest(arg, args[*pos - 1]);
+    }
+
+    (*pos)++;
+    return arg[0] != '\0';
+}
+
+int testAnd(char **args, int count, int *pos, int *error) {
+    int value = testPrimary(args, count, pos, error);
+    while (*pos < count && strcmp(args[*pos], "-a") == 0) {
+        (*pos)++;
+        value = testPrimary(args, count, pos, error) && value;
+    }
+    return value;
+}
+
+int testOr(char **args, int count, int *pos, int *error) {
+    int value = testAnd(args, count, pos, error);
+    while (*pos < count && strcmp(args[*pos], "-o") == 0) {
+        (*pos)++;
+        value = testAnd(args, count, pos, error) || value;
+    }
+    return value;
+}
+
+// test expression, or [ expression ]. Exits 0 if it is true, 1 if false and 2 on an error.
+int builtinTest(struct command *curr) {
+    int count = curr->numArgs;
+    int error = 0;
+    int pos = 0;
+
+    if (strcmp(curr->name, "[") == 0) {
+        if (count == 0 || strcmp(curr->args[count - 1], "]") != 0) {
+            printf("[: missing ]\n");
+            fflush(stdout);
+            return 2;
+        }
+        count--;
+    }
+
+    // POSIX decides by the number of arguments up to four, so "test -n" and "test !" are strings
+    char **args = curr->args;
+    int value;
+    if (count == 0) {
+        return 1;
+    } else if (count == 1) {
+        value = args[0][0] != '\0';
+    } else if (count == 2 && strcmp(args[0], "!") == 0) {
+        value = args[1][0] == '\0';
+    } else if (count == 3 && isBinaryTest(args[1])) {
+        value = binaryTest(args[0], args[1], args[2], &error);
+    } else {
+        value = testOr(args, count, &pos, &error);
+        if (error == 0 && pos != count) {
+            printf("test: %s: unexpected argument\n", args[pos]);
+            fflush(stdout);
+            error = 1;
+        }
+    }
+
+    return error ? 2 : !value;
+}
+
+// Prints one printf conversion, the spec is everything from % to the conversion letter
+void printConversion(char *spec, char conversion, const char *arg) {
+    int length = strlen(spec);
+
+    switch (conversion) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': {
+        // 'c turns into the code of c
+        long long value = arg[0] == '\'' || arg[0] == '"' ? (unsigned char)arg[1] : strtoll(arg, NULL, 0);
+        spec[length - 1] = 'l';
+        spec[length] = 'l';
+        spec[length + 1] = conversion;
+        spec[length + 2] = '\0';
+        printf(spec, value);
+        break;
+    }
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        printf(spec, strtod(arg, NULL));
+        break;
+    case 'c':
+        // An empty argument prints no character, only the padding
+        if (arg[0] == '\0') {
+            spec[length - 1] = 's';
+            printf(spec, "");
+        } else {
+            printf(spec, arg[0]);
+        }
+        break;
+    default:
+        printf(spec, arg);
+        break;
+    }
+}
+
+// printf format [args], the format is reused until every argument is consumed
+int builtinPrintf(struct command *curr) {
+    if (curr->numArgs == 0) {
+        printf("printf: usage: printf format [arguments]\n");
+        fflush(stdout);
+        return 2;
+    }
+
+    const char *format = curr->args[0];
+    int next = 1;
+    do {
+        int consumed = 0;
+        for (const char *p = format; *p != '\0'; p++) {
+            if (*p == '\\') {
+                // Escapes in the format, one at a time with the digits of \0nnn or \xHH
+                char escape[6] = { '\\', p[1], '\0' };
+                if (p[1] == '\0') {
+                    putchar('\\');
+                    continue;
+                }
+                const char *digits = p[1] == '0' ? "01234567" : (p[1] == 'x' ? "0123456789abcdefABCDEF" : "");
+                int numDigits = 0;
+                while (numDigits < (p[1] == '0' ? 3 : 2) && p[2 + numDigits] != '\0' && strchr(digits, p[2 + numDigits]) != NULL) {
+                    escape[2 + numDigits] = p[2 + numDigits];
+                    numDigits++;
+                }
+                escape[2 + numDigits] = '\0';
+                if (p[1] == '"' || p[1] == '\'') {
+                    putchar(p[1]);
+                } else if (writeEscapes(escape) == 1) {
+                    fflush(stdout);
+                    return 0;
+                }
+                p += 1 + numDigits;
+                continue;
+            }
+            if (*p != '%') {
+                putchar(*p);
+                continue;
+            }
+            if (p[1] == '%') {
+                putchar('%');
+                p++;
+                continue;
+            }
+
+            // Copy flags, width and precision into a spec for the C printf
+            char spec[64];
+            int length = 0;
+            spec[length++] = *p++;
+            while (*p != '\0' && strchr("-+ #0123456789.", *p) != NULL && length < 56) {
+                spec[length++] = *p++;
+            }
+            if (*p == '\0') {
+                break;
+            }
+            spec[length++] = *p;
+            spec[length] = '\0';
+
+            const char *arg = next < curr->numArgs ? curr->args[next++] : "";
+            consumed = 1;
+            if (*p == 'b') {
+                spec[length - 1] = 's';
+                if (writeEscapes(arg) == 1) {
+                    fflush(stdout);
+                    return 0;
+                }
+            } else if (strchr("diouxXfFeEgGaAcs", *p) != NULL) {
+                printConversion(spec, *p, arg);
+            } else {
+                printf("printf: %%%c: invalid conversion\n", *p);
+                fflush(stdout);
+                return 1;
+            }
+        }
+
+        // A format without conversions is printed once
+        if (consumed == 0) {
+            break;
+        }
+    } while (next < curr->numArgs);
+    fflush(stdout);
+
+    return 0;
+}
+
+int builtinPwd(struct command *curr) {
+    char cwd[4096];
+
+    (void)curr;
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("pwd");
+        fflush(stdout);
+        return 1;
+    }
+    printf("%s\n", cwd);
+    fflush(stdout);
+
+    return 0;
+}
+
+// Signal names kill knows, by number
+struct signalName {
+    const char *name;
+    int number;
+};
+
+struct signalName signalNames[] = {
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "ILL", SIGILL }, { "TRAP", SIGTRAP },
+    { "ABRT", SIGABRT }, { "BUS", SIGBUS }, { "FPE", SIGFPE }, { "KILL", SIGKILL }, { "USR1", SIGUSR1 },
+    { "SEGV", SIGSEGV }, { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+    { "CHLD", SIGCHLD }, { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP }, { "TTIN", SIGTTIN },
+    { "TTOU", SIGTTOU }, { "URG", SIGURG }, { "XCPU", SIGXCPU }, { "XFSZ", SIGXFSZ }, { "WINCH", SIGWINCH },
+};
+
+// Returns the number of a signal given as a name, SIGNAME or number, or -1
+int parseSignal(const char *text) {
+    if (isdigit((unsigned char)text[0])) {
+        return atoi(text);
+    }
+    if (strncmp(text, "SIG", 3) == 0) {
+        text += 3;
+    }
+    for (size_t i = 0; i < sizeof(signalNames) / sizeof(signalNames[0]); i++) {
+        if (strcasecmp(text, signalNames[i].name) == 0) {
+            return signalNames[i].number;
+        }
+    }
+
+    return -1;
+}
+
+// kill [-s sig | -sig] pid|%job ..., or kill -l
+int builtinKill(struct command *curr) {
+    int sig = SIGTERM;
+    int i = 0;
+    int status = 0;
+
+    if (curr->numArgs > 0 && strcmp(curr->args[0], "-l") == 0) {
+        for (size_t j = 0; j < sizeof(signalNames) / sizeof(signalNames[0]); j++) {
+            printf("%2d) SIG%s\n", signalNames[j].number, signalNames[j].name);
+        }
+        fflush(stdout);
+        return 0;
+    }
+
+    if (i < curr->numArgs && (strcmp(curr->args[i], "-s") == 0 || strcmp(curr->args[i], "-n") == 0)) {
+        sig = i + 1 < curr->numArgs ? parseSignal(curr->args[i + 1]) : -1;
+        i += 2;
+    } else if (i < curr->numArgs && curr->args[i][0] == '-' && curr->args[i][1] != '\0') {
+        sig = parseSignal(curr->args[i] + 1);
+        i++;
+    }
+    if (sig == -1) {
+        printf("kill: invalid signal\n");
+        fflush(stdout);
+        return 2;
+    }
+    if (i == curr->numArgs) {
+        printf("kill: usage: kill [-s sig | -sig] pid | %%job ...\n");
+        fflush(stdout);
+        return 2;
+    }
+
+    for (; i < curr->numArgs; i++) {
+        int result;
+        if (curr->args[i][0] == '%') {
+            struct job *target = parseJobSpec(&jobTable, curr->args[i], "kill");
+            if (target == NULL) {
+                status = 1;
+                continue;
+            }
+            result = signalJob(target, sig);
+        } else {
+            // A job's process goes through its pidfd, which cannot name a process that reused
+            // the pid, and one that was reaped already is not signalled
+            struct job *target = findJob(&jobTable, atoi(curr->args[i]));
+            if (target != NULL && target->state == JOB_DONE) {
+                errno = ESRCH;
+                result = -1;
+            } else if (target != NULL && target->pidfd != -1) {
+                result = sendPidfdSignal(target->pidfd, sig);
+            } else {
+                result = kill(atoi(curr->args[i]), sig);
+            }
+        }
+        if (result == -1) {
+            fprintf(stdout, "kill: %s: %s\n", curr->args[i], strerror(errno));
+            fflush(stdout);
+            status = 1;
+        }
+    }
+
+    return status;
+}
+
+// The builtins that were always part of the shell, wrapped to the dispatch table's signature
+int builtinCd(struct command *curr) {
+    executeCD(curr);
+    return 0;
+}
+
+int builtinExit(struct command *curr) {
+    (void)curr;
+    arenaFree(&lineArena);
+    freeProcess(currProc);
+    executeExit(&jobTable);
+    return 0;
+}
+
+int builtinStatus(struct command *curr) {
+    (void)curr;
+    if(currProc == NULL) {
+        printf("exit value 0\n");
+    } else {
+        if(currProc->exited == 1) {
+            printf("exit value %d\n", currProc->exitStatus);
+        } else {
+            printf("terminated by signal %d\n", currProc->exitStatus);
+        }
+    }
+    fflush(stdout);
+    return 0;
+}
+
+int builtinHash(struct command *curr) {
+    executeHash(curr);
+    return 0;
+}
+
+int builtinSet(struct command *curr) {
+    executeSet(curr);
+    return 0;
+}
+
+int builtinBuffers(struct command *curr) {
+    executeBuffers(curr);
+    return 0;
+}
+
+int builtinPool(struct command *curr) {
+    executePool(curr);
+    return 0;
+}
+
+int builtinTiming(struct command *curr) {
+    executeTiming(curr);
+    return 0;
+}
+
+int builtinJobs(struct command *curr) {
+    (void)curr;
+    executeJobs(&jobTable);
+    return 0;
+}
+
+int builtinFg(struct command *curr) {
+    struct process *fgProc = executeFg(&jobTable, curr);
+    if (fgProc != NULL) {
+        freeProcess(currProc);
+        currProc = fgProc;
+    }
+    return 0;
+}
+
+int builtinBg(struct command *curr) {
+    executeBg(&jobTable, curr);
+    return 0;
+}
+
+int builtinWait(struct command *curr) {
+    setStatus(executeWait(&jobTable, curr));
+    return 0;
+}
+
+int builtinParallel(struct command *curr) {
+    executeParallel(curr);
+    return 0;
+}
+
+int builtinHistory(struct command *curr) {
+    executeHistory(curr);
+    return 0;
+}
+
+// A builtin that stands in for an external command. It only runs in the shell for a single
+// foreground command, and its exit code becomes the status like the command's would.
+#define BUILTIN_NATIVE 1
+
+struct builtin {
+    const char *name;
+    int (*run)(struct command *curr);
+    int flags;
+};
+
+struct builtin builtins[] = {
+    { "cd", builtinCd, 0 },
+    { "exit", builtinExit, 0 },
+    { "status", builtinStatus, 0 },
+    { "hash", builtinHash, 0 },
+    { "set", builtinSet, 0 },
+    { "buffers", builtinBuffers, 0 },
+    { "pool", builtinPool, 0 },
+    { "timing", builtinTiming, 0 },
+    { "jobs", builtinJobs, 0 },
+    { "fg", builtinFg, 0 },
+    { "bg", builtinBg, 0 },
+    { "wait", builtinWait, 0 },
+    { "parallel", builtinParallel, 0 },
+    { "history", builtinHistory, 0 },
+    { "echo", builtinEcho, BUILTIN_NATIVE },
+    { "true", builtinTrue, BUILTIN_NATIVE },
+    { "false", builtinFalse, BUILTIN_NATIVE },
+    { "test", builtinTest, BUILTIN_NATIVE },
+    { "[", builtinTest, BUILTIN_NATIVE },
+    { "printf", builtinPrintf, BUILTIN_NATIVE },
+    { "pwd", builtinPwd, BUILTIN_NATIVE },
+    { "kill", builtinKill, BUILTIN_NATIVE },
+};
+
+// Perfect hash of the builtin names: the seed is picked at startup so every name gets its own
+// slot, then a lookup is one hash and one strcmp
+#define BUILTIN_SLOTS 128
+struct builtin *builtinSlots[BUILTIN_SLOTS];
+unsigned int builtinSeed = 0;
+
+unsigned int hashBuiltin(const char *name, unsigned int seed) {
+    unsigned int hash = 2166136261u ^ seed;
+
+    while (*name != '\0') {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+
+    return (hash ^ (hash >> 15)) & (BUILTIN_SLOTS - 1);
+}
+
+// Finds a seed that puts every builtin in a different slot
+void initBuiltins(void) {
+    int count = sizeof(builtins) / sizeof(builtins[0]);
+
+    for (builtinSeed = 1; ; builtinSeed++) {
+        memset(builtinSlots, 0, sizeof(builtinSlots));
+        int i;
+        for (i = 0; i < count; i++) {
+            unsigned int slot = hashBuiltin(builtins[i].name, builtinSeed);
+            if (builtinSlots[slot] != NULL) {
+                break;
+            }
+            builtinSlots[slot] = &builtins[i];
+        }
+        if (i == count) {
+            return;
+        }
+    }
+}
+
+// Returns the builtin with a name, or NULL
+struct builtin *findBuiltin(const char *name) {
+    struct builtin *curr = builtinSlots[hashBuiltin(name, builtinSeed)];
+
+    return curr != NULL && strcmp(curr->name, name) == 0 ? curr : NULL;
+}
+
+// Returns 1 if a command name is a native builtin, which a pool worker runs without exec
+int isNativeBuiltin(const char *name) {
+    struct builtin *builtin = findBuiltin(name);
+
+    return builtin != NULL && (builtin->flags & BUILTIN_NATIVE) != 0;
+}
+
+// Runs a native builtin in a pool worker in place of its external command, its fds are already
+// in place. A worker starts without the builtin table, so it is built here. Returns the exit code.
+int runWorkerBuiltin(int argc, char **argv) {
+    struct command curr;
+
+    initBuiltins();
+    memset(&curr, 0, sizeof(curr));
+    curr.name = argv[0];
+    curr.args = argv + 1;
+    curr.numArgs = argc - 1;
+    int code = findBuiltin(curr.name)->run(&curr);
+    fflush(stdout);
+
+    return code;
+}
+
+// Runs a builtin in the shell. Its redirections are put on the shell's own fds for the
+// duration and the originals are restored afterwards. Returns the builtin's exit code.
+int runBuiltin(struct builtin *builtin, struct command *curr) {
+    int saved[3] = { -1, -1, -1 };
+    int fds[3];
+    int redirected = curr->input != NULL || curr->output != NULL || curr->errput != NULL || curr->errorToOutput;
+
+    if (redirected == 1) {
+        // & does not send a builtin's output to /dev/null
+        int ampersand = curr->ampersand;
+        curr->ampersand = 0;
+        int result = openRedirections(curr, -1, -1, fds);
+        curr->ampersand = ampersand;
+        if (result == -1) {
+            return 1;
+        }
+
+        fflush(stdout);
+        fflush(stderr);
+        for (int i = 0; i < 3; i++) {
+            if (fds[i] != -1) {
+                saved[i] = dupCloexec(i);
+                dup2(fds[i], i);
+            }
+        }
+        closeRedirections(fds);
+    }
+
+    int status = builtin->run(curr);
+
+    if (redirected == 1) {
+        fflush(stdout);
+        fflush(stderr);
+        for (int i = 0; i < 3; i++) {
+            if (saved[i] != -1) {
+                dup2(saved[i], i);
+                close(saved[i]);
+            }
+        }
+    }
+
+    return status;
+}
+
+// Returns 1 if a command writes to a buffer, which a builtin cannot since the shell reads it
+int capturesOutput(struct command *curr) {
+    return (curr->output != NULL && curr->output[0] == '@') || (curr->errput != NULL && curr->errput[0] == '@');
+}
+
+// Prints the foreground-only mode change the SIGTSTP handler asked for
+void announceForegroundMode(void) {
+    if(foregroundOnly == 1) {
+        printf("Entering foreground-only mode (& is now ignored)\n");
+        fflush(stdout);
+        foregroundOnly = 0;
+    } else if(notForegroundOnly == 1) {
+        printf("Exiting foreground-only mode\n");
+        fflush(stdout);
+        notForegroundOnly = 0;
+    }
+}
+
+// A directory of $PATH as the executable index last saw it
+struct pathDir {
+    char *path;
+    struct stat info; // Device, inode and mtime when it was scanned
+    int watch; // inotify watch, -1 if it has none and is checked with stat
+    int stale; // 1 if it has to be scanned again
+    char **names; // Its executables
+    int count;
+};
+
+// Executables on $PATH for command completion, built the first time Tab needs it. A directory
+// is only rescanned when inotify reports a change in it or, without inotify, its mtime moves,
+// so a completion costs a binary search instead of a readdir of every directory.
+struct execIndex {
+    char *path; // $PATH the index was built for, NULL before the first completion
+    struct pathDir *dirs;
+    int numDirs;
+    char **names; // Every directory's names, sorted and without duplicates
+    int numNames;
+    int inotify; // -1 if inotify is not available
+    int changed; // 1 if a directory was rescanned since names was merged
+};
+
+struct execIndex execIndex = { NULL, NULL, 0, NULL, 0, -1, 0 };
+
+// Frees the names read from a $PATH directory
+void freePathNames(struct pathDir *dir) {
+    for (int i = 0; i < dir->count; i++) {
+        free(dir->names[i]);
+    }
+    free(dir->names);
+    dir->names = NULL;
+    dir->count = 0;
+}
+
+// Reads the executables of one $PATH directory
+void scanPathDir(struct pathDir *dir) {
+    freePathNames(dir);
+    dir->stale = 0;
+
+    // The mtime is taken first so a change during the scan is caught next time
+    if (stat(dir->path, &dir->info) == -1) {
+        return;
+    }
+    DIR *stream = opendir(dir->path);
+    if (stream == NULL) {
+        return;
+    }
+
+    int capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(stream)) != NULL) {
+        struct stat info;
+        if (entry->d_name[0] == '.' || entry->d_type == DT_DIR ||
+            fstatat(dirfd(stream), entry->d_name, &info, 0) == -1 ||
+            !S_ISREG(info.st_mode) || (info.st_mode & 0111) == 0) {
+            continue;
+        }
+        if (dir->count == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            dir->names = realloc(dir->names, capacity * sizeof(char *));
+        }
+        dir->names[dir->count++] = strdup(entry->d_name);
+    }
+    closedir(stream);
+}
+
+// Drops the index, its directories and their watches
+void clearExecIndex(void) {
+    for (int i = 0; i < execIndex.numDirs; i++) {
+        freePathNames(&execIndex.dirs[i]);
+        free(execIndex.dirs[i].path);
+    }
+    free(execIndex.dirs);
+    free(execIndex.names);
+    free(execIndex.path);
+    if (execIndex.inotify != -1) {
+        close(execIndex.inotify);
+    }
+    execIndex = (struct execIndex){ NULL, NULL, 0, NULL, 0, -1, 0 };
+}
+
+int compareNames(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Brings the executable index up to date with $PATH and its directories
+void refreshExecIndex(void) {
+    const char *path = getenv("PATH") != NULL ? getenv("PATH") : "/usr/bin:/bin";
+
+    // A new $PATH starts the index over
+    if (execIndex.path == NULL || strcmp(execIndex.path, path) != 0) {
+        clearExecIndex();
+        execIndex.path = strdup(path);
+        execIndex.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        execIndex.dirs = malloc((strlen(path) + 1) * sizeof(struct pathDir));
+
+        for (const char *p = path; ; p++) {
+            size_t length = strcspn(p, ":");
+            struct pathDir *dir = &execIndex.dirs[execIndex.numDirs++];
+            memset(dir, 0, sizeof(struct pathDir));
+            dir->path = length == 0 ? strdup(".") : strndup(p, length);
+            dir->stale = 1;
+            dir->watch = -1;
+
+            // Relative entries move with the cwd, so only stat can tell they changed
+            if (execIndex.inotify != -1 && dir->path[0] == '/') {
+                dir->watch = inotify_add_watch(execIndex.inotify, dir->path,
+                                               IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                               IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+            }
+            p += length;
+            if (*p == '\0') {
+                break;
+            }
+        }
+    }
+
+    // inotify names the directories that changed
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t got;
+    while (execIndex.inotify != -1 && (got = read(execIndex.inotify, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + got; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            for (int i = 0; i < execIndex.numDirs; i++) {
+                if (execIndex.dirs[i].watch == ((struct inotify_event *)p)->wd) {
+                    execIndex.dirs[i].stale = 1;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < execIndex.numDirs; i++) {
+        struct pathDir *dir = &execIndex.dirs[i];
+        struct stat info;
+        if (dir->stale == 0 && dir->watch == -1 &&
+            (stat(dir->path, &info) == -1 ? dir->info.st_ino != 0 :
+             info.st_ino != dir->info.st_ino || info.st_dev != dir->info.st_dev ||
+             info.st_mtim.tv_sec != dir->info.st_mtim.tv_sec || info.st_mtim.tv_nsec != dir->info.st_mtim.tv_nsec)) {
+            dir->stale = 1;
+        }
+        if (dir->stale == 1) {
+            memset(&dir->info, 0, sizeof(dir->info));
+            scanPathDir(dir);
+            execIndex.changed = 1;
+        }
+    }
+
+    // Merge the directories into one sorted list of names
+    if (execIndex.changed == 1) {
+        int total = 0;
+        for (int i = 0; i < execIndex.numDirs; i++) {
+            total += execIndex.dirs[i].count;
+        }
+        execIndex.names = realloc(execIndex.names, (total > 0 ? total : 1) * sizeof(char *));
+        execIndex.numNames = 0;
+        for (int i = 0; i < execIndex.numDirs; i++) {
+            memcpy(execIndex.names + execIndex.numNames, execIndex.dirs[i].names, execIndex.dirs[i].count * sizeof(char *));
+            execIndex.numNames += execIndex.dirs[i].count;
+        }
+        qsort(execIndex.names, execIndex.numNames, sizeof(char *), compareNames);
+
+        int unique = 0;
+        for (int i = 0; i < execIndex.numNames; i++) {
+            if (unique == 0 || strcmp(execIndex.names[unique - 1], execIndex.names[i]) != 0) {
+                execIndex.names[unique++] = execIndex.names[i];
+            }
+        }
+        execIndex.numNames = unique;
+        execIndex.changed = 0;
+    }
+}
+
+// Candidates for a completion
+struct completions {
+    char **items;
+    int count;
+    int capacity;
+};
+
+void addCompletion(struct completions *list, const char *item) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        list->items = realloc(list->items, list->capacity * sizeof(char *));
+    }
+    list->items[list->count++] = strdup(item);
+}
+
+// Finds the commands, executables and builtins, that start with prefix
+void completeCommand(const char *prefix, struct completions *list) {
+    size_t length = strlen(prefix);
+
+    refreshExecIndex();
+    int low = 0;
+    int high = execIndex.numNames;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (strcmp(execIndex.names[middle], prefix) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    for (int i = low; i < execIndex.numNames && strncmp(execIndex.names[i], prefix, length) == 0; i++) {
+        addCompletion(list, execIndex.names[i]);
+    }
+
+    int found = list->count;
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        int seen = 0;
+        for (int j = 0; j < found && seen == 0; j++) {
+            seen = strcmp(list->items[j], builtins[i].name) == 0;
+        }
+        if (seen == 0 && strncmp(builtins[i].name, prefix, length) == 0) {
+            addCompletion(list, builtins[i].name);
+        }
+    }
+}
+
+// Finds the paths that start with word, directories get a trailing /
+void completePath(const char *word, struct completions *list) {
+    char dir[4096];
+    const char *slash = strrchr(word, '/');
+    const char *base = slash == NULL ? word : slash + 1;
+    int dirLength = slash == NULL ? 0 : slash - word + 1;
+
+    if (dirLength == 0) {
+        strcpy(dir, ".");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", dirLength, word);
+    }
+
+    DIR *stream = opendir(dir);
+    if (stream == NULL) {
+        return;
+    }
+
+    char item[4096];
+    struct dirent *entry;
+    size_t length = strlen(base);
+    while ((entry = readdir(stream)) != NULL) {
+        if (strncmp(entry->d_name, base, length) != 0 || strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0 || (entry->d_name[0] == '.' && base[0] != '.')) {
+            continue;
+        }
+
+        struct stat info;
+        int isDir = entry->d_type == DT_DIR ||
+                    ((entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) &&
+                     fstatat(dirfd(stream), entry->d_name, &info, 0) == 0 && S_ISDIR(info.st_mode));
+        snprintf(item, sizeof(item), "%.*s%s%s", dirLength, word, entry->d_name, isDir ? "/" : "");
+        addCompletion(list, item);
+    }
+    closedir(stream);
+}
+
+// Raw-mode line editor for a terminal prompt
+#define EDIT_MAX 4096
+struct lineEditor {
+    int enabled; // 1 if the prompt is on a terminal the editor can drive
+    int active; // 1 while a line is being edited
+    struct termios cooked; // Terminal settings to go back to
+    const char *prompt;
+    char buf[EDIT_MAX];
+    int length;
+    int pos; // Cursor position in buf
+    char saved[EDIT_MAX]; // The typed line while the history is browsed
+    size_t historyOffset; // History line being shown, history.mapped for the typed line
+};
+
+struct lineEditor editor;
+
+// Returns the width of the terminal
+int terminalColumns(void) {
+    struct winsize size;
+    return ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 ? size.ws_col : 80;
+}
+
+// Draws the prompt and line, scrolled sideways if it is wider than the terminal
+void refreshLine(void) {
+    char out[EDIT_MAX + 256];
+    int columns = terminalColumns();
+    int promptLength = strlen(editor.prompt);
+    int start = 0;
+
+    while (promptLength + editor.pos - start >= columns && start < editor.pos) {
+        start++;
+    }
+    int visible = editor.length - start;
+    if (promptLength + visible > columns) {
+        visible = columns - promptLength;
+    }
+    if (visible < 0) {
+        visible = 0;
+    }
+
+    int n = snprintf(out, sizeof(out), "\r%s%.*s\x1b[K\r", editor.prompt, visible, editor.buf + start);
+    if (promptLength + editor.pos - start > 0) {
+        n += snprintf(out + n, sizeof(out) - n, "\x1b[%dC", promptLength + editor.pos - start);
+    }
+    write(STDOUT_FILENO, out, n);
+}
+
+// Prints the prompt again after job reports, with the line being edited if there is one
+void redrawPrompt(void) {
+    if (editor.active == 1) {
+        refreshLine();
+    } else {
+        printf("%s", activePrompt);
+        fflush(stdout);
+    }
+}
+
+// Replaces the text from start to the cursor with text
+void replaceWord(int start, const char *text) {
+    int length = strlen(text);
+    int tail = editor.length - editor.pos;
+
+    if (start + length + tail >= EDIT_MAX) {
+        return;
+    }
+    memmove(editor.buf + start + length, editor.buf + editor.pos, tail);
+    memcpy(editor.buf + start, text, length);
+    editor.pos = start + length;
+    editor.length = start + length + tail;
+}
+
+// Completes the word before the cursor: a command name in command position, otherwise a path.
+// One match is inserted whole, several are shortened to what they share or listed.
+void completeLine(void) {
+    char word[EDIT_MAX];
+    int start = editor.pos;
+
+    while (start > 0 && !isspace((unsigned char)editor.buf[start - 1]) && strchr("|;&<>", editor.buf[start - 1]) == NULL) {
+        start--;
+    }
+    int before = start;
+    while (before > 0 && isspace((unsigned char)editor.buf[before - 1])) {
+        before--;
+    }
+    memcpy(word, editor.buf + start, editor.pos - start);
+    word[editor.pos - start] = '\0';
+
+    struct completions list = { NULL, 0, 0 };
+    if ((before == 0 || strchr("|;&", editor.buf[before - 1]) != NULL) && strchr(word, '/') == NULL) {
+        completeCommand(word, &list);
+    } else {
+        completePath(word, &list);
+    }
+
+    if (list.count == 1) {
+        replaceWord(start, list.items[0]);
+        if (list.items[0][strlen(list.items[0]) - 1] != '/') {
+            replaceWord(editor.pos, " ");
+        }
+    } else if (list.count > 1) {
+        // Extend the word to what every match shares
+        int common = strlen(list.items[0]);
+        for (int i = 1; i < list.count; i++) {
+            int j = 0;
+            while (j < common && list.items[i][j] == list.items[0][j]) {
+                j++;
+            }
+            common = j;
+        }
+
+        if (common > (int)strlen(word)) {
+            list.items[0][common] = '\0';
+            replaceWord(start, list.items[0]);
+        } else {
+            // Nothing to add, so show the choices
+            qsort(list.items, list.count, sizeof(char *), compareNames);
+            printf("\n");
+            for (int i = 0; i < list.count && i < 200; i++) {
+                printf("%s%s", list.items[i], i + 1 < list.count ? "  " : "");
+            }
+            if (list.count > 200) {
+                printf("... and %d more", list.count - 200);
+            }
+            printf("\n");
+            fflush(stdout);
+        }
+    }
+
+    for (int i = 0; i < list.count; i++) {
+        free(list.items[i]);
+    }
+    free(list.items);
+}
+
+// Goes back to the typed line, the history line being shown is gone once the file is reset
+void forgetHistoryPosition(void) {
+    if (editor.historyOffset < history.mapped) {
+        editor.length = editor.pos = strlen(editor.saved);
+        memcpy(editor.buf, editor.saved, editor.length);
+    }
+    editor.historyOffset = (size_t)-1;
+}
+
+// Shows the history line before (up) or after the one shown, the typed line comes after the last
+void browseHistory(int up) {
+    if (mapHistory() == -1) {
+        return;
+    }
+    if (editor.historyOffset > history.mapped) {
+        editor.historyOffset = history.mapped;
+    }
+
+    size_t offset = editor.historyOffset;
+    if (up == 1) {
+        if (offset == 0) {
+            return;
+        }
+        char *end = offset < 2 ? NULL : memrchr(history.map, '\n', offset - 1);
+        offset = end == NULL ? 0 : end - history.map + 1;
+    } else {
+        if (offset == history.mapped) {
+            return;
+        }
+        offset = (char *)memchr(history.map + offset, '\n', history.mapped - offset) - history.map + 1;
+    }
+
+    // Keep what was typed before leaving it
+    if (editor.historyOffset == history.mapped) {
+        memcpy(editor.saved, editor.buf, editor.length);
+        editor.saved[editor.length] = '\0';
+    }
+    editor.historyOffset = offset;
+
+    if (offset == history.mapped) {
+        editor.length = strlen(editor.saved);
+        memcpy(editor.buf, editor.saved, editor.length);
+    } else {
+        char *end = memchr(history.map + offset, '\n', history.mapped - offset);
+        editor.length = end - (history.map + offset);
+        if (editor.length >= EDIT_MAX) {
+            editor.length = EDIT_MAX - 1;
+        }
+        memcpy(editor.buf, history.map + offset, editor.length);
+    }
+    editor.pos = editor.length;
+    refreshLine();
+}
+
+// Reads a key, escape sequences for the arrows and friends become one of the KEY_ values
+#define KEY_LEFT 1000
+#define KEY_RIGHT 1001
+#define KEY_UP 1002
+#define KEY_DOWN 1003
+#define KEY_HOME 1004
+#define KEY_END 1005
+#define KEY_DELETE 1006
+
+int readKey(void) {
+    unsigned char c;
+    unsigned char seq[3];
+
+    if (waitForInput(&stdinReader) == -1 || read(STDIN_FILENO, &c, 1) != 1) {
+        return -1;
+    }
+    if (c != 27) {
+        return c;
+    }
+
+    // The rest of a sequence arrives with its escape, a lone escape is ignored
+    struct pollfd input = { STDIN_FILENO, POLLIN, 0 };
+    if (poll(&input, 1, 50) != 1 || read(STDIN_FILENO, seq, 1) != 1 ||
+        poll(&input, 1, 50) != 1 || read(STDIN_FILENO, seq + 1, 1) != 1) {
+        return 0;
+    }
+    if (seq[0] == '[' && seq[1] >= '0' && seq[1] <= '9') {
+        if (poll(&input, 1, 50) != 1 || read(STDIN_FILENO, seq + 2, 1) != 1 || seq[2] != '~') {
+            return 0;
+        }
+        switch (seq[1]) {
+        case '1': case '7': return KEY_HOME;
+        case '4': case '8': return KEY_END;
+        case '3': return KEY_DELETE;
+        }
+        return 0;
+    }
+    switch (seq[1]) {
+    case 'A': return KEY_UP;
+    case 'B': return KEY_DOWN;
+    case 'C': return KEY_RIGHT;
+    case 'D': return KEY_LEFT;
+    case 'H': return KEY_HOME;
+    case 'F': return KEY_END;
+    }
+    return 0;
+}
+
+// Edits one line at a terminal prompt in raw mode. Returns its length with the newline, like
+// readLine, or -1 at end of input.
+ssize_t editLine(const char *prompt, char **line, size_t *len) {
+    struct termios raw = editor.cooked;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    editor.prompt = prompt;
+    editor.length = editor.pos = 0;
+    editor.historyOffset = (size_t)-1;
+    editor.active = 1;
+    refreshLine();
+
+    ssize_t result = -2;
+    while (result == -2) {
+        int key = readKey();
+        int word = editor.pos;
+
+        switch (key) {
+        case -1:
+            result = -1;
+            break;
+        case '\r':
+        case '\n':
+            result = editor.length;
+            break;
+        case 3: // ctrl-C drops the line
+            editor.length = 0;
+            write(STDOUT_FILENO, "^C", 2);
+            result = 0;
+            break;
+        case 4: // ctrl-D ends the input on an empty line, otherwise deletes
+            if (editor.length == 0) {
+                result = -1;
+                break;
+            }
+            // Fall through
+        case KEY_DELETE:
+            if (editor.pos < editor.length) {
+                memmove(editor.buf + editor.pos, editor.buf + editor.pos + 1, editor.length - editor.pos - 1);
+                editor.length--;
+            }
+            break;
+        case 127:
+        case 8:
+            if (editor.pos > 0) {
+                memmove(editor.buf + editor.pos - 1, editor.buf + editor.pos, editor.length - editor.pos);
+                editor.pos--;
+                editor.length--;
+            }
+            break;
+        case '\t':
+            completeLine();
+            break;
+        case 1: case KEY_HOME:
+            editor.pos = 0;
+            break;
+        case 5: case KEY_END:
+            editor.pos = editor.length;
+            break;
+        case 2: case KEY_LEFT:
+            editor.pos -= editor.pos > 0;
+            break;
+        case 6: case KEY_RIGHT:
+            editor.pos += editor.pos < editor.length;
+            break;
+        case 16: case KEY_UP:
+            browseHistory(1);
+            break;
+        case 14: case KEY_DOWN:
+            browseHistory(0);
+            break;
+        case 11: // ctrl-K cuts to the end
+            editor.length = editor.pos;
+            break;
+        case 21: // ctrl-U cuts to the start
+            memmove(editor.buf, editor.buf + editor.pos, editor.length - editor.pos);
+            editor.length -= editor.pos;
+            editor.pos = 0;
+            break;
+        case 23: // ctrl-W cuts the word before the cursor
+            while (word > 0 && editor.buf[word - 1] == ' ') {
+                word--;
+            }
+            while (word > 0 && editor.buf[word - 1] != ' ') {
+                word--;
+            }
+            memmove(editor.buf + word, editor.buf + editor.pos, editor.length - editor.pos);
+            editor.length -= editor.pos - word;
+            editor.pos = word;
+            break;
+        case 12: // ctrl-L clears the screen
+            write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+            break;
+        default:
+            if (key >= 32 && key < 256 && editor.length + 1 < EDIT_MAX) {
+                memmove(editor.buf + editor.pos + 1, editor.buf + editor.pos, editor.length - editor.pos);
+                editor.buf[editor.pos++] = key;
+                editor.length++;
+
+                // Typing at the end of a line that fits only needs the character echoed
+                if (editor.pos == editor.length && (int)strlen(prompt) + editor.length < terminalColumns()) {
+                    char c = key;
+                    write(STDOUT_FILENO, &c, 1);
+                    continue;
+                }
+            }
+            break;
+        }
+        if (result == -2) {
+            refreshLine();
+        }
+    }
+
+    editor.active = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &editor.cooked);
+    write(STDOUT_FILENO, "\n", 1);
+    if (result == -1) {
+        return -1;
+    }
+
+    // Hand the line out like readLine does, newline and all
+    if (*line == NULL || *len < (size_t)editor.length + 2) {
+        *len = editor.length + 2;
+        *line = realloc(*line, *len);
+    }
+    memcpy(*line, editor.buf, editor.length);
+    (*line)[editor.length] = '\n';
+    (*line)[editor.length + 1] = '\0';
+    return editor.length + 1;
+}
+
+// Turns the line editor on if stdin and stdout are a terminal that can take escape sequences
+void initEditor(void) {
+    const char *term = getenv("TERM");
+
+    editor.enabled = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO) &&
+                     (term == NULL || strcmp(term, "dumb") != 0) &&
+                     tcgetattr(STDIN_FILENO, &editor.cooked) == 0;
+}
+
+// Prints a prompt and reads a line, through the editor on a terminal
+ssize_t promptLine(struct lineReader *reader, const char *prompt, char **line, size_t *len) {
+    ssize_t read;
+
+    activePrompt = prompt;
+    if (editor.enabled == 1 && reader == &stdinReader) {
+        read = editLine(prompt, line, len);
+    } else {
+        if (interactive == 1) {
+            printf("%s", prompt);
+            fflush(stdout);
+        }
+        read = readLine(reader, line, len);
+    }
+    activePrompt = NULL;
+
+    return read;
+}
+
+// Expands and runs one parsed command line, expansions go in the line arena
+void runCommandLine(struct command *curr) {
+    // If the command struct is not valid, there is nothing to run
+    if (curr == NULL) {
+        return;
+    }
+
+    // Expand the variables that waited until the command runs
+    struct command *expand = expandVariables(&lineArena, curr);
+
+    // limit runs the command after its options with resource limits. It works on a copy
+    // since a parsed command may run again, in a loop.
+    struct limits limits;
+    struct command limited;
+    if (strcmp(expand->name, "limit") == 0) {
+        limited = *expand;
+        expand = &limited;
+        if (startLimits(&limits, expand) == -1) {
+            return;
+        }
+        launchLimits = &limits;
+    }
+
+    // Builtins are looked up in the dispatch table. The native ones stand in for external
+    // commands, so pipelines, background jobs, limits and captures still launch the real one.
+    struct builtin *builtin = findBuiltin(expand->name);
+    int external = expand->next != NULL || (expand->ampersand == 1 && activated == 0) ||
+                   launchLimits != NULL || expand->capture != NULL || capturesOutput(expand);
+    if (builtin != NULL && (builtin->flags & BUILTIN_NATIVE) != 0 && external == 0) {
+        traceRecord(TRACE_EXECUTE, 'B', 0);
+        setStatus(runBuiltin(builtin, expand));
+        traceRecord(TRACE_EXECUTE, 'E', 0);
+    }
+    else if (builtin != NULL && (builtin->flags & BUILTIN_NATIVE) == 0) {
+        if (capturesOutput(expand)) {
+            printf("%s: builtins cannot write to a buffer\n", expand->name);
+            fflush(stdout);
+        } else {
+            runBuiltin(builtin, expand);
+        }
+    // Otherwise, execute the command
+    }
+    else {
+        if(expand->ampersand == 0 || activated == 1) {
+            freeProcess(currProc);
+            currProc = executeCommand(expand);
+            recordTiming(commandText(expand), currProc);
+        } else {
+            // Background commands go into the job table before their exit can be reaped
+            sigset_t block, old;
+            sigemptyset(&block);
+            sigaddset(&block, SIGCHLD);
+            sigprocmask(SIG_BLOCK, &block, &old);
+            struct process *bgProc = executeCommand(expand);
+            char *cgroup = launchLimits == NULL ? NULL : finishLimits(&limits);
+            if (bgProc->pid != -1) {
+                struct job *job = addJob(&jobTable, bgProc->pid, bgProc->pgid, commandText(expand), bgProc->started);
+                job->cgroup = cgroup;
+                job->pidfd = bgProc->pidfd;
+            } else {
+                removeCgroup(cgroup);
+            }
+            sigprocmask(SIG_SETMASK, &old, NULL);
+            freeProcess(bgProc);
+        }
+    }
+
+    // A foreground command's cgroup is empty once it has been waited for
+    if (launchLimits != NULL) {
+        removeCgroup(finishLimits(&limits));
+    }
+}
+
+// Returns the shell's exit code for the last foreground status
+int lastExitCode(void) {
+    if (currProc == NULL) {
+        return 0;
+    }
+
+    return currProc->exited == 1 ? currProc->exitStatus : 128 + currProc->exitStatus;
+}
+
+// Kinds of nodes in a parsed command
+#define NODE_PIPELINE 0
+#define NODE_AND 1 // condition && body
+#define NODE_OR 2 // condition || body
+#define NODE_IF 3 // if condition then body else otherwise
+#define NODE_WHILE 4 // while condition do body, or until if negate is set
+#define NODE_FOR 5 // for variable in the arguments of pipeline do body
+
+// A parsed command list. Pipelines are lexed once with LEX_DEFER and only their deferred
+// words are expanded each time they run, so a loop body is never tokenized again.
+struct node {
+    int type;
+    struct command *pipeline; // The pipeline, or the words of a for loop as arguments of "in"
+    char *source; // Text of a pipeline with a command substitution, reparsed each time it runs
+    struct node *condition;
+    struct node *body;
+    struct node *otherwise;
+    struct node *next; // Next command of the list
+    char *variable; // Loop variable of a for
+    int negate;
+};
+
+// Hands the parser the lines of a command, from a script in memory or from a line reader
+struct parser {
+    struct arena *arena;
+    char *text; // Rest of the script, NULL to read from reader
+    char *end;
+    struct lineReader *reader;
+    char *input; // readLine buffer for continuation lines
+    size_t inputLength;
+    int lines; // Lines read so far
+    char *line; // Line being parsed, its tokens are in tokenBuffer
+    char *source; // Copy of the line from before it was lexed if it has a substitution, or NULL
+    int count;
+    int pos; // Next token
+    int background; // 1 if the last pipeline ended with &
+    int failed; // 1 once an error was printed
+};
+
+// Lexes a line for the parser
+void lexParserLine(struct parser *ps, char *line) {
+    const char *error = NULL;
+
+    ps->source = hasSubstitution(line) ? copyToken(ps->arena, line) : NULL;
+    ps->line = line;
+    ps->pos = 0;
+    ps->lines++;
+    ps->count = lexLine(ps->arena, line, LEX_DEFER, &error);
+    if (ps->count == -1) {
+        printf("%s\n", error);
+        fflush(stdout);
+        ps->count = 0;
+        ps->failed = 1;
+    }
+}
+
+// Moves the parser to its next line, returns 0 if there is none
+int nextLine(struct parser *ps) {
+    if (ps->text != NULL) {
+        if (ps->text >= ps->end) {
+            return 0;
+        }
+        char *line = ps->text;
+        char *end = memchr(line, '\n', ps->end - line);
+        if (end == NULL) {
+            end = ps->end;
+        }
+        *end = '\0';
+        ps->text = end + 1;
+        lexParserLine(ps, line);
+        return 1;
+    }
+
+    // An unfinished command at the prompt continues on the next line
+    ssize_t read = promptLine(ps->reader, "> ", &ps->input, &ps->inputLength);
+    if (read == -1) {
+        return 0;
+    }
+    lexParserLine(ps, copyToken(ps->arena, ps->input));
+    return 1;
+}
+
+// Returns the next token, or NULL at the end of the line. With more set the command is not
+// finished, so blank lines are skipped and NULL means the input ran out.
+struct token *peekToken(struct parser *ps, int more) {
+    while (ps->pos == ps->count) {
+        if (more == 0 || ps->failed == 1 || nextLine(ps) == 0) {
+            return NULL;
+        }
+    }
+
+    return &tokenBuffer[ps->pos];
+}
+
+// Prints a syntax error at a token, NULL being the end of the input, and fails the parse
+struct node *parseError(struct parser *ps, struct token *token) {
+    if (ps->failed == 0) {
+        if (token == NULL && ps->pos == ps->count) {
+            printf("syntax error: unexpected end of file\n");
+            fflush(stdout);
+        } else {
+            syntaxError(ps->line, token);
+        }
+    }
+    ps->failed = 1;
+
+    return NULL;
+}
+
+// Returns 1 if a token is the given reserved word
+int isKeyword(struct parser *ps, struct token *token, const char *word) {
+    return token != NULL && token->type == TOKEN_WORD && token->raw == NULL && strcmp(tokenText(ps->line, token), word) == 0;
+}
+
+// Returns 1 if a token is one of a NULL-terminated list of reserved words
+int isAnyKeyword(struct parser *ps, struct token *token, const char **words) {
+    for (; *words != NULL; words++) {
+        if (isKeyword(ps, token, *words)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Consumes a reserved word the command needs next
+int expectKeyword(struct parser *ps, const char *word) {
+    struct token *token = peekToken(ps, 1);
+
+    if (!isKeyword(ps, token, word)) {
+        parseError(ps, token);
+        return 0;
+    }
+    ps->pos++;
+    return 1;
+}
+
+struct node *newNode(struct arena *arena, int type) {
+    struct node *node = arenaAlloc(arena, sizeof(struct node));
+
+    memset(node, 0, sizeof(struct node));
+    node->type = type;
+    return node;
+}
+
+// Keeps the text of tokens start..end-1 if it has a command substitution, which can only run
+// when the pipeline does
+char *pipelineSource(struct parser *ps, int start, int end) {
+    if (ps->source == NULL) {
+        return NULL;
+    }
+
+    int from = tokenBuffer[start].start;
+    int to = end < ps->count ? tokenBuffer[end].start : (int)strlen(ps->source);
+    char *text = arenaAlloc(ps->arena, to - from + 1);
+    memcpy(text, ps->source + from, to - from);
+    text[to - from] = '\0';
+
+    return hasSubstitution(text) ? text : NULL;
+}
+
+// Parses a pipeline up to the next ; && || or the end of the line, & is part of it
+struct node *parsePipelineNode(struct parser *ps) {
+    int start = ps->pos;
+    int end = start;
+
+    while (end < ps->count && tokenBuffer[end].type != TOKEN_SEMI &&
+           tokenBuffer[end].type != TOKEN_AND && tokenBuffer[end].type != TOKEN_OR) {
+        if (tokenBuffer[end++].type == TOKEN_AMPERSAND) {
+            break;
+        }
+    }
+    if (end == start) {
+        return parseError(ps, peekToken(ps, 0));
+    }
+
+    struct node *node = newNode(ps->arena, NODE_PIPELINE);
+    node->source = pipelineSource(ps, start, end);
+    node->pipeline = parsePipeline(ps->arena, ps->line, tokenBuffer, start, end);
+    if (node->pipeline == NULL) {
+        ps->failed = 1;
+        return NULL;
+    }
+    ps->pos = end;
+    ps->background = node->pipeline->ampersand;
+
+    return node;
+}
+
+struct node *parseList(struct parser *ps, const char **stops);
+
+// Parses if, or the elif that continues one: if list then list [elif ...] [else list] fi
+struct node *parseIf(struct parser *ps) {
+    static const char *thenStops[] = { "then", NULL };
+    static const char *elseStops[] = { "elif", "else", "fi", NULL };
+    static const char *fiStops[] = { "fi", NULL };
+    struct node *node = newNode(ps->arena, NODE_IF);
+
+    ps->pos++;
+    if ((node->condition = parseList(ps, thenStops)) == NULL || expectKeyword(ps, "then") == 0 ||
+        (node->body = parseList(ps, elseStops)) == NULL) {
+        return NULL;
+    }
+
+    // An elif is an if in the else branch that shares the fi
+    struct token *token = peekToken(ps, 1);
+    if (isKeyword(ps, token, "elif")) {
+        node->otherwise = parseIf(ps);
+        return node->otherwise == NULL ? NULL : node;
+    }
+    if (isKeyword(ps, token, "else")) {
+        ps->pos++;
+        if ((node->otherwise = parseList(ps, fiStops)) == NULL) {
+            return NULL;
+        }
+    }
+
+    return expectKeyword(ps, "fi") ? node : NULL;
+}
+
+// Parses while list do list done, or until
+struct node *parseWhile(struct parser *ps) {
+    static const char *doStops[] = { "do", NULL };
+    static const char *doneStops[] = { "done", NULL };
+    struct node *node = newNode(ps->arena, NODE_WHILE);
+
+    node->negate = isKeyword(ps, peekToken(ps, 0), "until");
+    ps->pos++;
+    if ((node->condition = parseList(ps, doStops)) == NULL || expectKeyword(ps, "do") == 0 ||
+        (node->body = parseList(ps, doneStops)) == NULL || expectKeyword(ps, "done") == 0) {
+        return NULL;
+    }
+
+    return node;
+}
+
+// Parses for name in words; do list done
+struct node *parseFor(struct parser *ps) {
+    static const char *doneStops[] = { "done", NULL };
+    struct node *node = newNode(ps->arena, NODE_FOR);
+
+    ps->pos++;
+    struct token *token = peekToken(ps, 0);
+    if (token == NULL || token->type != TOKEN_WORD || token->raw != NULL) {
+        return parseError(ps, token);
+    }
+    node->variable = tokenText(ps->line, token);
+    if (node->variable[strspn(node->variable, "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789")] != '\0' ||
+        isdigit((unsigned char)node->variable[0])) {
+        printf("for: %s: not a valid name\n", node->variable);
+        fflush(stdout);
+        ps->failed = 1;
+        return NULL;
+    }
+    ps->pos++;
+
+    // The words are the arguments of a command named "in", so they expand like any other
+    if (!isKeyword(ps, peekToken(ps, 0), "in")) {
+        return parseError(ps, peekToken(ps, 0));
+    }
+    int end = ps->pos;
+    while (end < ps->count && tokenBuffer[end].type == TOKEN_WORD) {
+        end++;
+    }
+    node->source = pipelineSource(ps, ps->pos, end);
+    node->pipeline = parsePipeline(ps->arena, ps->line, tokenBuffer, ps->pos, end);
+    ps->pos = end;
+
+    token = peekToken(ps, 0);
+    if (token != NULL && token->type == TOKEN_SEMI) {
+        ps->pos++;
+    } else if (token != NULL) {
+        return parseError(ps, token);
+    }
+
+    if (expectKeyword(ps, "do") == 0 || (node->body = parseList(ps, doneStops)) == NULL ||
+        expectKeyword(ps, "done") == 0) {
+        return NULL;
+    }
+
+    return node;
+}
+
+// Parses a pipeline or a compound command
+struct node *parseCommand(struct parser *ps) {
+    static const char *reserved[] = { "then", "elif", "else", "fi", "do", "done", NULL };
+    struct token *token = peekToken(ps, 1);
+
+    ps->background = 0;
+    if (token == NULL || isAnyKeyword(ps, token, reserved)) {
+        return parseError(ps, token);
+    }
+    if (isKeyword(ps, token, "if")) {
+        return parseIf(ps);
+    }
+    if (isKeyword(ps, token, "while") || isKeyword(ps, token, "until")) {
+        return parseWhile(ps);
+    }
+    if (isKeyword(ps, token, "for")) {
+        return parseFor(ps);
+    }
+
+    return parsePipelineNode(ps);
+}
+
+// Parses commands joined by && and ||, a line may end after either
+struct node *parseAndOr(struct parser *ps) {
+    struct node *left = parseCommand(ps);
+
+    while (left != NULL) {
+        struct token *token = peekToken(ps, 0);
+        if (token == NULL || (token->type != TOKEN_AND && token->type != TOKEN_OR)) {
+            break;
+        }
+        if (ps->background == 1) {
+            return parseError(ps, token);
+        }
+
+        struct node *node = newNode(ps->arena, token->type == TOKEN_AND ? NODE_AND : NODE_OR);
+        ps->pos++;
+        node->condition = left;
+        if ((node->body = parseCommand(ps)) == NULL) {
+            return NULL;
+        }
+        left = node;
+    }
+
+    return left;
+}
+
+// Parses commands separated by ; & and newlines. At the top level, where stops is NULL, the
+// list ends with the line. Inside a compound command it goes on over lines until a command
+// would start with one of the stop words.
+struct node *parseList(struct parser *ps, const char **stops) {
+    struct node *head = NULL;
+    struct node **tail = &head;
+
+    while (1) {
+        struct token *token = peekToken(ps, stops != NULL);
+        if (token == NULL) {
+            return stops == NULL ? head : parseError(ps, NULL);
+        }
+        if (stops != NULL && isAnyKeyword(ps, token, stops)) {
+            return head != NULL ? head : parseError(ps, token);
+        }
+
+        struct node *node = parseAndOr(ps);
+        if (node == NULL) {
+            return NULL;
+        }
+        *tail = node;
+        tail = &node->next;
+
+        // A command ends at ; or the end of the line, or right after an &
+        token = peekToken(ps, 0);
+        if (token != NULL && token->type == TOKEN_SEMI) {
+            ps->pos++;
+        } else if (token != NULL && ps->background == 0) {
+            return parseError(ps, token);
+        }
+    }
+}
+
+// Parses the command on the parser's line and any lines a compound command goes on to.
+// Returns NULL for a blank line or after an error.
+struct node *parseCommandLine(struct parser *ps) {
+    traceRecord(TRACE_PARSE, 'B', 0);
+    struct node *node = ps->count > 0 ? parseList(ps, NULL) : NULL;
+    traceRecord(TRACE_PARSE, 'E', 0);
+
+    return ps->failed == 1 ? NULL : node;
+}
+
+// Parsed prompt lines by their text, so a line typed again is not parsed again
+#define AST_CACHE_SIZE 256
+#define AST_CACHE_BYTES (1 << 20)
+
+struct astEntry {
+    char *line; // NULL if the slot is empty
+    struct node *node;
+};
+
+struct astCache {
+    struct astEntry entries[AST_CACHE_SIZE];
+    int count;
+    size_t bytes; // Source parsed since the cache was last cleared, bounds its arena
+    struct arena arena;
+};
+
+struct astCache astCache;
+
+// Returns the parsed command for a line typed at the prompt, from the cache if it was seen before.
+// A command that went on to more lines is parsed every time.
+struct node *parseInteractive(struct lineReader *reader, char *line) {
+    unsigned int mask = AST_CACHE_SIZE - 1;
+    unsigned int i = hashString(line) & mask;
+
+    for (; astCache.entries[i].line != NULL; i = (i + 1) & mask) {
+        if (strcmp(astCache.entries[i].line, line) == 0) {
+            return astCache.entries[i].node;
+        }
+    }
+
+    // Start over rather than evict, a full cache mostly holds lines that will not come again
+    astCache.bytes += strlen(line);
+    if ((astCache.count + 1) * 4 > AST_CACHE_SIZE * 3 || astCache.bytes > AST_CACHE_BYTES) {
+        memset(astCache.entries, 0, sizeof(astCache.entries));
+        astCache.count = 0;
+        astCache.bytes = strlen(line);
+        arenaReset(&astCache.arena);
+        for (i = hashString(line) & mask; astCache.entries[i].line != NULL; i = (i + 1) & mask) {
+        }
+    }
+
+    struct parser ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.arena = &astCache.arena;
+    ps.reader = reader;
+    lexParserLine(&ps, copyToken(ps.arena, line));
+    struct node *node = parseCommandLine(&ps);
+    free(ps.input);
+
+    if (node != NULL && ps.lines == 1) {
+        astCache.entries[i].line = copyToken(ps.arena, line);
+        astCache.entries[i].node = node;
+        astCache.count++;
+    }
+
+    return node;
+}
+
+// Returns the command a node runs, a pipeline with a substitution is parsed again so it runs now
+struct command *nodeCommand(struct arena *arena, struct node *node) {
+    if (node->source == NULL) {
+        return node->pipeline;
+    }
+
+    struct command *curr = processLine(arena, copyToken(arena, node->source), LEX_EXPAND);
+    if (curr == NULL) {
+        setStatus(1);
+    }
+    return curr;
+}
+
+// Returns 1 if a loop should stop because the user pressed ctrl-C
+int loopInterrupted(void) {
+    return interrupted == 1 || (currProc != NULL && currProc->exited == 0 && currProc->exitStatus == SIGINT);
+}
+
+int runNode(struct node *node);
+
+// Runs a while or until loop
+void runWhile(struct node *node) {
+    int ran = 0;
+
+    while ((runNode(node->condition) == 0) != node->negate && !loopInterrupted()) {
+        runNode(node->body);
+        ran = 1;
+        if (loopInterrupted()) {
+            break;
+        }
+        removeProcesses(&jobTable);
+    }
+
+    if (ran == 0) {
+        setStatus(0);
+    }
+}
+
+// Runs a for loop, its words are expanded once before the first pass
+void runFor(struct node *node) {
+    struct arena wordArena = { NULL, 0, 0, 0, 0 };
+    struct command *words = nodeCommand(&wordArena, node);
+
+    setStatus(0);
+    if (words != NULL) {
+        expandVariables(&wordArena, words);
+        for (int i = 0; i < words->numArgs && !loopInterrupted(); i++) {
+            setVariable(node->variable, words->args[i]);
+            runNode(node->body);
+            removeProcesses(&jobTable);
+        }
+    }
+    arenaFree(&wordArena);
+}
+
+// Runs a parsed list and returns the exit code of the last command that ran
+int runNode(struct node *node) {
+    // ctrl-C drops the rest of the list
+    for (struct node *first = node; node != NULL && (node == first || interrupted == 0); node = node->next) {
+        switch (node->type) {
+        case NODE_PIPELINE: {
+            struct command *curr = nodeCommand(&lineArena, node);
+            runCommandLine(curr);
+            arenaReset(&lineArena);
+            break;
+        }
+
+        case NODE_AND:
+        case NODE_OR:
+            if ((runNode(node->condition) == 0) == (node->type == NODE_AND)) {
+                runNode(node->body);
+            }
+            break;
+
+        case NODE_IF:
+            if (runNode(node->condition) == 0) {
+                runNode(node->body);
+            } else if (node->otherwise != NULL) {
+                runNode(node->otherwise);
+            } else {
+                setStatus(0);
+            }
+            break;
+
+        case NODE_WHILE:
+        case NODE_FOR: {
+            // ctrl-C stops a loop, through handleSIGINT while the shell has the terminal and
+            // through reportInterrupt while a job has it
+            interrupted = 0;
+            if (node->type == NODE_WHILE) {
+                runWhile(node);
+            } else {
+                runFor(node);
+            }
+            break;
+        }
+        }
+    }
+
+    return lastExitCode();
+}
+
+// Parses the text of a command substitution, returns its list or NULL after an error
+struct node *parseSubstitution(struct arena *arena, char *text) {
+    struct node *head = NULL;
+    struct node **tail = &head;
+    struct parser ps;
+
+    memset(&ps, 0, sizeof(ps));
+    ps.arena = arena;
+    ps.text = text;
+    ps.end = text + strlen(text);
+    while (nextLine(&ps)) {
+        *tail = parseCommandLine(&ps);
+        if (ps.failed == 1) {
+            return NULL;
+        }
+        while (*tail != NULL) {
+            tail = &(*tail)->next;
+        }
+    }
+
+    return head;
+}
+
+// Returns 1 if a list is one pipeline, which a substitution launches without a subshell
+int isSinglePipeline(struct node *list) {
+    return list->type == NODE_PIPELINE && list->next == NULL && list->negate == 0;
+}
+
+// Runs a list in a forked copy of the shell with its input from in and its output going to out,
+// either -1 to keep the shell's, for a substitution or parallel line that holds more than one
+// pipeline. Returns the pid or -1.
+pid_t startSubshell(struct node *list, int in, int out) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        if (pid == -1) {
+            perror("Failed to fork");
+            fflush(stdout);
+        }
+        return pid;
+    }
+
+    // The copy leaves the terminal, the parent's jobs, pool workers and captures alone, and
+    // reaps its own children
+    if (in != -1) {
+        dup2(in, STDIN_FILENO);
+        close(in);
+    }
+    if (out != -1) {
+        dup2(out, STDOUT_FILENO);
+        close(out);
+    }
+    for (int i = 0; i < numPendingCaptures; i++) {
+        close(pendingCaptures[i].fd);
+    }
+    numPendingCaptures = 0;
+    jobControl = 0;
+    parallelRun = NULL;
+    freeJobTable(&jobTable);
+    pool.numIdle = pool.size = 0;
+    close(wakePipe[0]);
+    close(wakePipe[1]);
+    if (childEpoll != -1) {
+        close(childEpoll);
+        childEpoll = -1;
+    }
+    initReaper();
+    if (childEpoll == -1) {
+        signal(SIGCHLD, childHandleSig);
+    }
+    sigprocmask(SIG_SETMASK, &shellMask, NULL);
+
+    interrupted = 0;
+    int code = runNode(list);
+    fflush(stdout);
+    _exit(code);
+}
+
+// Runs a whole script without prompting. Every line is parsed up front, then the parsed
+// commands run in order. The text is modified in place, and a last line without a newline
+// is ended by writing text[length], so that byte must be writable too.
+int runScript(char *text, size_t length) {
+    // Count the lines so the parsed commands fit in one array
+    size_t numLines = 1;
+    for (char *p = text; (p = memchr(p, '\n', text + length - p)) != NULL; p++) {
+        numLines++;
+    }
+
+    // The parsed script lives as long as the run, each command's expansions only until it finishes
+    struct arena scriptArena = { NULL, 0, 0, 0, 0 };
+    struct node **commands = arenaAlloc(&scriptArena, numLines * sizeof(struct node *));
+    size_t count = 0;
+
+    // Parse every command, a compound one takes the lines up to its end
+    struct parser ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.arena = &scriptArena;
+    ps.text = text;
+    ps.end = text + length;
+    while (nextLine(&ps)) {
+        struct node *node = parseCommandLine(&ps);
+        if (node != NULL) {
+            commands[count++] = node;
+        }
+        ps.failed = 0;
+    }
+
+    // Run the commands
+    for (size_t i = 0; i < count; i++) {
+        removeProcesses(&jobTable);
+        refillPool();
+        announceForegroundMode();
+        interrupted = 0;
+        runNode(commands[i]);
+    }
+    arenaFree(&scriptArena);
+
+    removeProcesses(&jobTable);
+    int code = lastExitCode();
+    freeProcess(currProc);
+    freeJobTable(&jobTable);
+
+    return code;
+}
+
+// Runs a script file, or stdin when path is NULL, by mapping it into memory
+int runScriptFile(char *path) {
+    int fd = path == NULL ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+
+    if (fd == -1 || fstat(fd, &info) == -1) {
+        perror("Failed to open script");
+        fflush(stdout);
+        return 1;
+    }
+    if (info.st_size == 0) {
+        return 0;
+    }
+
+    // A private mapping lets the tokenizer write into the text without touching the file. It
+    // goes over an anonymous one a byte longer, which holds the end of a last line without a
+    // newline when the file fills its last page.
+    size_t mapped = info.st_size + 1;
+    char *text = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (text != MAP_FAILED &&
+        mmap(text, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(text, mapped);
+        text = MAP_FAILED;
+    }
+    if (text == MAP_FAILED) {
+        perror("Failed to map script");
+        fflush(stdout);
+        return 1;
+    }
+    madvise(text, info.st_size, MADV_SEQUENTIAL);
+    if (path != NULL) {
+        close(fd);
+    }
+
+    int code = runScript(text, info.st_size);
+    munmap(text, mapped);
+
+    return code;
+}
+
+// Latencies of one benchmark stage
+struct benchStage {
+    const char *name;
+    double *samples; // Seconds taken by each operation, NULL if only the total is known
+    int count; // Operations run
+    double elapsed; // Wall time of the whole stage
+    double bytes; // Input processed, 0 if not meaningful
+    double allocations; // Arena requests per operation, 0 if not counted
+    double mallocs; // mallocs per operation behind those requests
+};
+
+int benchJson = 0; // 1 if --bench prints JSON
+int benchStages = 0; // Stages reported so far
+
+// Starts a stage that keeps one sample per operation
+void beginStage(struct benchStage *stage, const char *name, int count) {
+    stage->name = name;
+    stage->samples = malloc(count * sizeof(double));
+    stage->count = 0;
+    stage->elapsed = 0;
+    stage->bytes = 0;
+    stage->allocations = 0;
+    stage->mallocs = 0;
+}
+
+// Adds the time since start as one operation
+void addSample(struct benchStage *stage, double start) {
+    double now = monotonicSeconds();
+    stage->samples[stage->count++] = now - start;
+    stage->elapsed += now - start;
+}
+
+int compareSamples(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Returns the sample at a percentile by nearest rank, the samples must be sorted
+double percentile(struct benchStage *stage, double p) {
+    int rank = (int)(p / 100 * stage->count + 0.999999);
+    return stage->samples[rank < 1 ? 0 : rank - 1];
+}
+
+// Prints a stage's p50/p99 latency and throughput, then frees its samples
+void reportStage(struct benchStage *stage) {
+    double rate = stage->elapsed > 0 ? stage->count / stage->elapsed : 0;
+    double p50 = -1, p99 = -1;
+
+    if (stage->samples != NULL && stage->count > 0) {
+        qsort(stage->samples, stage->count, sizeof(double), compareSamples);
+        p50 = percentile(stage, 50) * 1e6;
+        p99 = percentile(stage, 99) * 1e6;
+    }
+
+    if (benchJson == 1) {
+        printf("%s\n    {\"stage\": \"%s\", \"count\": %d, \"ops_per_sec\": %.1f",
+               benchStages == 0 ? "" : ",", stage->name, stage->count, rate);
+        if (p50 >= 0) {
+            printf(", \"p50_us\": %.3f, \"p99_us\": %.3f", p50, p99);
+        }
+        if (stage->bytes > 0) {
+            printf(", \"mb_per_sec\": %.1f", stage->bytes / 1e6 / stage->elapsed);
+        }
+        if (stage->allocations > 0) {
+            printf(", \"allocs_per_op\": %.1f, \"mallocs_per_op\": %.5f", stage->allocations, stage->mallocs);
+        }
+        printf("}");
+    } else {
+        printf("%-24s %8d ops %12.0f ops/sec", stage->name, stage->count, rate);
+        if (p50 >= 0) {
+            printf("   p50 %9.3f us   p99 %9.3f us", p50, p99);
+        }
+        if (stage->bytes > 0) {
+            printf("   %.1f MB/s", stage->bytes / 1e6 / stage->elapsed);
+        }
+        if (stage->allocations > 0) {
+            printf("   %.1f allocs/op, %.5f mallocs/op", stage->allocations, stage->mallocs);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+
+    benchStages++;
+    free(stage->samples);
+    stage->samples = NULL;
+}
+
+// Runs /bin/true the given number of times with one launch engine
+void benchmarkLaunch(const char *name, int mode, int count) {
+    char path[] = "/bin/true";
+    struct command curr = { .name = path };
+    struct benchStage stage;
+    int status;
+
+    launchMode = mode;
+    beginStage(&stage, name, count);
+    for (int i = 0; i < count; i++) {
+        double start = monotonicSeconds();
+        pid_t pid = launchCommand(&curr, -1, 0);
+        if (pid == -1) {
+            break;
+        }
+        waitpid(pid, &status, 0);
+        addSample(&stage, start);
+    }
+    launchMode = LAUNCH_SPAWN;
+
+    reportStage(&stage);
+}
+
+// Runs a command through warm pool workers, /bin/true is exec'd by the worker and true runs in it
+// as a builtin. Refilling the pool happens while the shell would be idle, so it is its own stage
+// rather than part of each launch.
+void benchmarkPool(const char *name, const char *refillName, char *command, int count) {
+    struct command curr = { .name = command };
+    struct benchStage launch, refill;
+    int status;
+
+    pool.size = 4;
+    refillPool();
+    beginStage(&launch, name, count);
+    beginStage(&refill, refillName, count);
+    for (int i = 0; i < count; i++) {
+        double start = monotonicSeconds();
+        pid_t pid = launchCommand(&curr, -1, 0);
+        if (pid == -1) {
+            break;
+        }
+        waitpid(pid, &status, 0);
+        addSample(&launch, start);
+
+        start = monotonicSeconds();
+        refillPool();
+        addSample(&refill, start);
+    }
+    stopPool();
+
+    reportStage(&launch);
+    reportStage(&refill);
+}
+
+// Runs /bin/true in the foreground through executeCommand, the way the prompt does
+void benchmarkExecute(int count) {
+    char path[] = "/bin/true";
+    struct command curr = { .name = path };
+    struct benchStage stage;
+
+    beginStage(&stage, "executeCommand", count);
+    for (int i = 0; i < count; i++) {
+        double start = monotonicSeconds();
+        freeProcess(executeCommand(&curr));
+        addSample(&stage, start);
+    }
+
+    reportStage(&stage);
+}
+
+// Starts /bin/true in the background and times it until removeProcesses has reaped it,
+// so each sample covers the spawn, the reaping, the event loop wakeup and the job table
+void benchmarkBackground(int count) {
+    char line[] = "/bin/true &";
+    struct benchStage stage;
+    struct pollfd wake = { exitFd, POLLIN, 0 };
+
+    // The job messages would swamp the report
+    int savedStdout = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    if (childEpoll == -1) {
+        signal(SIGCHLD, childHandleSig);
+    }
+
+    beginStage(&stage, "background spawn+reap", count);
+    for (int i = 0; i < count; i++) {
+        char copy[sizeof(line)];
+        memcpy(copy, line, sizeof(line));
+
+        double start = monotonicSeconds();
+        runCommandLine(processLine(&lineArena, copy, LEX_EXPAND));
+        while (jobTable.count > 0) {
+            if (poll(&wake, 1, -1) == 1) {
+                drainWakePipe();
+            }
+            removeProcesses(&jobTable);
+        }
+        addSample(&stage, start);
+        arenaReset(&lineArena);
+    }
+
+    signal(SIGCHLD, SIG_DFL);
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+
+    reportStage(&stage);
+}
+
+// Starts numJobs background sleeps, then times shutting them all down as exit would
+void benchmarkShutdown(int numJobs) {
+    char line[] = "sleep 60 &";
+
+    // The job messages would swamp the report
+    int savedStdout = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    if (childEpoll == -1) {
+        signal(SIGCHLD, childHandleSig);
+    }
+
+    for (int i = 0; i < numJobs; i++) {
+        char copy[sizeof(line)];
+        memcpy(copy, line, sizeof(line));
+        runCommandLine(processLine(&lineArena, copy, LEX_EXPAND));
+        arenaReset(&lineArena);
+    }
+
+    struct benchStage stage = { "shutdown", NULL, 0, 0, 0, 0, 0 };
+    double start = monotonicSeconds();
+    stage.count = shutdownJobs(&jobTable, 0);
+    stage.elapsed = monotonicSeconds() - start;
+    freeJobTable(&jobTable);
+
+    signal(SIGCHLD, SIG_DFL);
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+
+    reportStage(&stage);
+}
+
+// Runs a copy of the shell on a script, each line of which is one operation
+void benchmarkShell(const char *name, char *scriptPath, int numLines, int batch) {
+    char self[] = "/proc/self/exe";
+    char flag[] = "-i";
+    char devNullPath[] = "/dev/null";
+    char *args[] = { batch ? scriptPath : flag };
+    struct command curr = { .name = self, .args = args, .numArgs = 1, .input = batch ? NULL : scriptPath,
+                            .output = devNullPath };
+    struct benchStage stage = { name, NULL, numLines, 0, 0, 0, 0 };
+    int status;
+
+    double start = monotonicSeconds();
+    pid_t pid = launchCommand(&curr, -1, 0);
+    if (pid != -1) {
+        waitpid(pid, &status, 0);
+    }
+    stage.elapsed = monotonicSeconds() - start;
+
+    reportStage(&stage);
+}
+
+// Compares the interactive prompt loop with batch mode on a script of builtins
+void benchmarkScript(int numLines) {
+    char path[] = "/tmp/smallsh-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("Failed to create benchmark script");
+        return;
+    }
+
+    // A builtin keeps the measurement on the shell rather than on launching commands
+    FILE *out = fdopen(fd, "w");
+    for (int i = 0; i < numLines; i++) {
+        fprintf(out, "set +o splice $$\n");
+    }
+    fclose(out);
+
+    benchmarkShell("script interactive", path, numLines, 0);
+    benchmarkShell("script batch", path, numLines, 1);
+    unlink(path);
+}
+
+// Runs the same script of native builtins in the shell and as external commands
+void benchmarkBuiltins(int numLines) {
+    const char *prefixes[] = { "", "/usr/bin/" };
+    const char *names[] = { "builtins native", "builtins external" };
+    numLines -= numLines % 3;
+
+    for (int i = 0; i < 2; i++) {
+        char path[] = "/tmp/smallsh-bench-XXXXXX";
+        int fd = mkstemp(path);
+        if (fd == -1) {
+            perror("Failed to create benchmark script");
+            return;
+        }
+
+        FILE *out = fdopen(fd, "w");
+        for (int j = 0; j < numLines; j += 3) {
+            fprintf(out, "%stest -d /tmp\n", prefixes[i]);
+            fprintf(out, "%secho line %d > /dev/null\n", prefixes[i], j);
+            fprintf(out, "%sprintf '%%s-%%d\\n' $? %d > /dev/null\n", prefixes[i], j);
+        }
+        fclose(out);
+
+        benchmarkShell(names[i], path, numLines, 1);
+        unlink(path);
+    }
+}
+
+// Indexes a history file of numLines lines, then times prefix and substring searches on it
+void benchmarkHistory(int numLines) {
+    char path[] = "/tmp/smallsh-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("Failed to create benchmark history");
+        return;
+    }
+
+    FILE *out = fdopen(fd, "w");
+    for (int i = 0; i < numLines; i++) {
+        fprintf(out, "command%d --flag=%d /some/path/file%d.txt\n", i % 5000, i, i % 977);
+    }
+    fflush(out);
+
+    struct history saved = history;
+    history.fd = fd;
+    history.path = NULL;
+    history.map = NULL;
+    history.size = history.mapped = history.indexed = history.numSorted = history.capacity = 0;
+    history.counted = history.numCounted = 0;
+    history.sorted = NULL;
+
+    struct benchStage index = { "history index", NULL, numLines, 0, 0, 0, 0 };
+    double start = monotonicSeconds();
+    indexHistory();
+    index.elapsed = monotonicSeconds() - start;
+    index.bytes = history.mapped;
+    reportStage(&index);
+
+    struct benchStage prefix, substring;
+    char text[32];
+    beginStage(&prefix, "history prefix", 1000);
+    for (int i = 0; i < 1000; i++) {
+        snprintf(text, sizeof(text), "command%d -", i * 7 % 5000);
+        start = monotonicSeconds();
+        newestWithPrefix(text);
+        addSample(&prefix, start);
+    }
+    reportStage(&prefix);
+
+    // The searched lines are at the end, so every search scans the whole file
+    int found = 0;
+    beginStage(&substring, "history substring", 10);
+    for (int i = 0; i < 10; i++) {
+        snprintf(text, sizeof(text), "flag=%d ", numLines - 1 - i);
+        start = monotonicSeconds();
+        found += memmem(history.map, history.mapped, text, strlen(text)) != NULL;
+        addSample(&substring, start);
+    }
+    if (found != 10) {
+        printf("history substring: %d of 10 found\n", found);
+    }
+    substring.bytes = (double)history.mapped * 10;
+    reportStage(&substring);
+
+    munmap(history.map, history.size);
+    free(history.sorted);
+    fclose(out);
+    unlink(path);
+    history = saved;
+}
+
+// Fills a $PATH directory with numFiles executables, then times building the completion index
+// over it and completing prefixes against it
+void benchmarkCompletion(int numFiles) {
+    char dir[] = "/tmp/smallsh-bench-XXXXXX";
+    char file[64];
+    if (mkdtemp(dir) == NULL) {
+        perror("Failed to create benchmark directory");
+        return;
+    }
+    for (int i = 0; i < numFiles; i++) {
+        snprintf(file, sizeof(file), "%s/tool%d-%d", dir, i % 1000, i);
+        close(open(file, O_WRONLY | O_CREAT, 0755));
+    }
+
+    char *savedPath = getenv("PATH") != NULL ? strdup(getenv("PATH")) : NULL;
+    setenv("PATH", dir, 1);
+    clearExecIndex();
+
+    struct benchStage index = { "completion index", NULL, numFiles, 0, 0, 0, 0 };
+    double start = monotonicSeconds();
+    refreshExecIndex();
+    index.elapsed = monotonicSeconds() - start;
+    reportStage(&index);
+
+    // Every lookup checks the directories for changes, as a Tab does
+    struct benchStage lookup;
+    char prefix[32];
+    int found = 0;
+    beginStage(&lookup, "completion lookup", 1000);
+    for (int i = 0; i < 1000; i++) {
+        struct completions list = { NULL, 0, 0 };
+        snprintf(prefix, sizeof(prefix), "tool%d-", i * 7 % 1000);
+        start = monotonicSeconds();
+        completeCommand(prefix, &list);
+        addSample(&lookup, start);
+        found += list.count;
+        for (int j = 0; j < list.count; j++) {
+            free(list.items[j]);
+        }
+        free(list.items);
+    }
+    if (found < numFiles) {
+        printf("completion lookup: %d of %d found\n", found, numFiles);
+    }
+    reportStage(&lookup);
+
+    clearExecIndex();
+    for (int i = 0; i < numFiles; i++) {
+        snprintf(file, sizeof(file), "%s/tool%d-%d", dir, i % 1000, i);
+        unlink(file);
+    }
+    rmdir(dir);
+    if (savedPath != NULL) {
+        setenv("PATH", savedPath, 1);
+        free(savedPath);
+    } else {
+        unsetenv("PATH");
+    }
+}
+
+// Runs a for loop whose body is native builtins, every pass reuses the parsed body
+void benchmarkLoop(int numPasses) {
+    char path[] = "/tmp/smallsh-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("Failed to create benchmark script");
+        return;
+    }
+
+    FILE *out = fdopen(fd, "w");
+    fprintf(out, "for i in");
+    for (int i = 0; i < numPasses; i++) {
+        fprintf(out, " %d", i);
+    }
+    fprintf(out, "; do\n    test $i -ge 0 && echo pass $i > /dev/null\ndone\n");
+    fclose(out);
+
+    benchmarkShell("for loop", path, numPasses, 1);
+    unlink(path);
+}
+
+// Times a for loop that runs a substitution on every pass, then checks that $i, $$ and $? were
+// expanded in each of them
+void benchmarkSubstitution(int numPasses) {
+    char path[] = "/tmp/smallsh-bench-XXXXXX";
+    char outPath[] = "/tmp/smallsh-bench-XXXXXX";
+    int fd = mkstemp(path);
+    int outFd = mkstemp(outPath);
+    if (fd == -1 || outFd == -1) {
+        perror("Failed to create benchmark script");
+        return;
+    }
+
+    FILE *out = fdopen(fd, "w");
+    fprintf(out, "for i in");
+    for (int i = 0; i < numPasses; i++) {
+        fprintf(out, " %d", i);
+    }
+    fprintf(out, "; do\n    false; echo $(echo sub$i $$ $?) >> %s\ndone\n", outPath);
+    fclose(out);
+
+    char self[] = "/proc/self/exe";
+    char *args[] = { path };
+    struct command curr = { .name = self, .args = args, .numArgs = 1 };
+    struct benchStage stage = { "substitution", NULL, numPasses, 0, 0, 0, 0 };
+    int status;
+
+    double start = monotonicSeconds();
+    pid_t pid = launchCommand(&curr, -1, 0);
+    if (pid != -1) {
+        waitpid(pid, &status, 0);
+    }
+    stage.elapsed = monotonicSeconds() - start;
+
+    // Every pass prints its number, the shell's pid and the status false left
+    FILE *in = fdopen(outFd, "r");
+    int expanded = 0;
+    int pass, shellPid, exitCode;
+    while (fscanf(in, "sub%d %d %d\n", &pass, &shellPid, &exitCode) == 3) {
+        expanded += pass == expanded && shellPid == pid && exitCode == 1;
+    }
+    if (expanded != numPasses) {
+        printf("substitution: %d of %d passes expanded\n", expanded, numPasses);
+    }
+    fclose(in);
+    unlink(outPath);
+    unlink(path);
+
+    reportStage(&stage);
+}
+
+// Times processLine and expandVariables separately on a typical line. With direct set every
+// allocation is a malloc and a free, as before the arena, for comparison.
+void benchmarkParse(int numLines, int direct) {
+    const char *sample = "grep -n 'a pattern' pattern$$ one.txt \"two three.txt\" < input$$ > output.txt 2>&1 ";
+    char line[128];
+    struct arena arena = { NULL, 0, 0, 0, direct };
+    struct benchStage parse, expand;
+
+    beginStage(&parse, direct == 1 ? "processLine malloc" : "processLine", numLines);
+    beginStage(&expand, direct == 1 ? "expandVariables malloc" : "expandVariables", numLines);
+    for (int i = 0; i < numLines; i++) {
+        strcpy(line, sample);
+
+        // Deferring leaves the $$ words for expandVariables, as in a batch script
+        double start = monotonicSeconds();
+        unsigned long requests = arena.requests;
+        unsigned long blocks = arena.blocks;
+        struct command *curr = processLine(&arena, line, LEX_DEFER);
+        addSample(&parse, start);
+        parse.allocations += arena.requests - requests;
+        parse.mallocs += arena.blocks - blocks;
+
+        start = monotonicSeconds();
+        requests = arena.requests;
+        blocks = arena.blocks;
+        expandVariables(&arena, curr);
+        expand.allocations += arena.requests - requests;
+        expand.mallocs += arena.blocks - blocks;
+
+        // Timed with the expansion, since it is where a malloc'd line would be freed
+        arenaReset(&arena);
+        addSample(&expand, start);
+    }
+
+    // Each arena request would have been its own malloc, plus a free, without the arena
+    parse.allocations /= numLines;
+    parse.mallocs /= numLines;
+    expand.allocations /= numLines;
+    expand.mallocs /= numLines;
+
+    reportStage(&parse);
+    reportStage(&expand);
+    arenaFree(&arena);
+}
+
+// Returns a random line of shell-like text built from words, quotes, escapes and operators
+size_t fuzzLine(char *line, size_t capacity, unsigned int *seed) {
+    static const char *pieces[] = {
+        "grep", "-n", "pattern", "file.txt", "'single quoted text'", "\"double $$ quoted\"",
+        "back\\ slash", "|", "<", ">", ">>", "2>", "2>&1", "&", "$$", "\t", "  ", "\\\"", "#", "'",
+    };
+    size_t numPieces = sizeof(pieces) / sizeof(pieces[0]);
+    size_t length = 0;
+
+    while (1) {
+        const char *piece = pieces[rand_r(seed) % numPieces];
+        size_t pieceLength = strlen(piece);
+        if (length + pieceLength + 2 >= capacity) {
+            break;
+        }
+        memcpy(line + length, piece, pieceLength);
+        length += pieceLength;
+        line[length++] = ' ';
+    }
+    line[length] = '\0';
+
+    return length;
+}
+
+// Measures lexer throughput on command text, and feeds it random bytes to make sure it never crashes
+void benchmarkLexer(int numLines) {
+    char text[256];
+    char line[256];
+    unsigned int seed = 42;
+    const char *error;
+    struct arena arena = { NULL, 0, 0, 0, 0 };
+    struct benchStage stage;
+
+    // Lex a fixed set of generated lines, restoring each before it is lexed again in place
+    char **lines = malloc(1024 * sizeof(char *));
+    size_t *lengths = malloc(1024 * sizeof(size_t));
+    for (int i = 0; i < 1024; i++) {
+        lengths[i] = fuzzLine(text, 64 + rand_r(&seed) % 160, &seed);
+        lines[i] = strdup(text);
+    }
+
+    beginStage(&stage, "lexLine", numLines);
+    for (int i = 0; i < numLines; i++) {
+        memcpy(line, lines[i & 1023], lengths[i & 1023] + 1);
+        double start = monotonicSeconds();
+        lexLine(&arena, line, LEX_EXPAND, &error);
+        addSample(&stage, start);
+        stage.bytes += lengths[i & 1023];
+        arenaReset(&arena);
+    }
+
+    reportStage(&stage);
+
+    // Random bytes, including NULs and unbalanced quotes. The stage is only reported if every
+    // line was lexed without a crash.
+    beginStage(&stage, "lexLine random bytes", numLines / 10);
+    for (int i = 0; i < numLines / 10; i++) {
+        size_t length = rand_r(&seed) % (sizeof(line) - 1);
+        for (size_t j = 0; j < length; j++) {
+            line[j] = rand_r(&seed) % 256;
+        }
+        line[length] = '\0';
+        double start = monotonicSeconds();
+        lexLine(&arena, line, LEX_EXPAND, &error);
+        addSample(&stage, start);
+        stage.bytes += length;
+        arenaReset(&arena);
+    }
+    reportStage(&stage);
+
+    for (int i = 0; i < 1024; i++) {
+        free(lines[i]);
+    }
+    free(lines);
+    free(lengths);
+    arenaFree(&arena);
+}
+
+// Function to run the benchmarks: smallsh --bench [--json] [count] [heap MB]
+int runBenchmarks(int argc, char *argv[]) {
+    int count = 2000;
+    int heapMB = 256;
+    int numbers = 0;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            benchJson = 1;
+        } else if (numbers++ == 0) {
+            count = atoi(argv[i]);
+        } else {
+            heapMB = atoi(argv[i]);
+        }
+    }
+    if (count <= 0) {
+        count = 2000;
+    }
+
+    if (initReaper() == -1) {
+        perror("Failed to create wake pipe");
+        return 1;
+    }
+    sigprocmask(SIG_BLOCK, NULL, &shellMask);
+
+    if (benchJson == 1) {
+        printf("{\"count\": %d, \"heap_mb\": %d, \"stages\": [", count, heapMB);
+    }
+
+    benchmarkLexer(count * 500);
+    benchmarkParse(count * 500, 0);
+    benchmarkParse(count * 500, 1);
+    benchmarkExecute(count);
+    benchmarkBackground(count);
+    benchmarkShutdown(count / 10 > 0 ? count / 10 : 1);
+    benchmarkScript(count * 50);
+    benchmarkBuiltins(count);
+    benchmarkLoop(count * 50);
+    benchmarkSubstitution(count);
+    benchmarkHistory(count * 1000);
+    benchmarkCompletion(count * 10);
+
+    // Touch a heap the size of a long-running shell so fork has page tables to copy
+    char *heap = NULL;
+    if (heapMB > 0) {
+        heap = malloc((size_t)heapMB << 20);
+        if (heap != NULL) {
+            memset(heap, 1, (size_t)heapMB << 20);
+        }
+    }
+
+    benchmarkLaunch("launch posix_spawn", LAUNCH_SPAWN, count);
+    benchmarkLaunch("launch fork", LAUNCH_FORK, count);
+    char exec[] = "/bin/true";
+    char builtin[] = "true";
+    benchmarkPool("launch pool", "pool refill", exec, count);
+    benchmarkPool("launch pool builtin", "pool refill builtin", builtin, count);
+
+    if (benchJson == 1) {
+        printf("\n]}\n");
+        fflush(stdout);
+    }
+
+    free(heap);
+    arenaFree(&lineArena);
+    freeJobTable(&jobTable);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char *userInput = NULL; // Stores the user input
+    char *script = NULL; // Path of a script to run, or NULL
+    char *commandString = NULL; // Commands given with -c, or NULL
+    int forceInteractive = 0;
+
+    // A pool worker only waits for its command
+    if (argc > 1 && strcmp(argv[1], "--pool-worker") == 0) {
+        return runPoolWorker(3);
+    }
+
+    initExpansion();
+    initTrace();
+    initBuiltins();
+
+    // Run the benchmarks instead of the shell if asked
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        return runBenchmarks(argc - 2, argv + 2);
+    }
+
+    // smallsh [-i] [-c commands | script]
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0) {
+            forceInteractive = 1;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            commandString = argv[++i];
+        } else if (script == NULL && commandString == NULL) {
+            script = argv[i];
+        }
+    }
+
+    // SMALLSH_LAUNCH=fork forces the fork fallback
+    char *launch = getenv("SMALLSH_LAUNCH");
+    if (launch != NULL && strcmp(launch, "fork") == 0) {
+        launchMode = LAUNCH_FORK;
+    }
+
+    // Set up signal handlers, commands start with the mask the shell started with
+    sigprocmask(SIG_BLOCK, NULL, &shellMask);
+    // When the shell owns its terminal jobs run in process groups of their own and get the
+    // terminal in turn, so ctrl-C and ctrl-Z reach the foreground job and not the shell
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGINT, handleSIGINT);
+    jobControl = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+    // Children the shell does not wait for are reaped through their pidfds, or by the SIGCHLD
+    // handler into the exit ring, and either way wake the event loop through exitFd
+    if (initReaper() == -1) {
+        perror("Failed to create wake pipe");
+        exit(1);
+    }
+    if (childEpoll == -1) {
+        signal(SIGCHLD, childHandleSig);
+    }
+
+    // Scripts, -c strings and redirected files are run in batch mode
+    if (commandString != NULL) {
+        return runScript(commandString, strlen(commandString));
+    }
+    if (script != NULL) {
+        return runScriptFile(script);
+    }
+
+    struct stat info;
+    if (forceInteractive == 0 && fstat(STDIN_FILENO, &info) == 0 && S_ISREG(info.st_mode)) {
+        return runScriptFile(NULL);
+    }
+
+    // Only a terminal gets a prompt
+    interactive = forceInteractive == 1 || isatty(STDIN_FILENO);
+    if (interactive == 1) {
+        openHistory();
+        initEditor();
+    }
+
+    // Set up for readLine, a pipe gets a bigger buffer than a terminal
+    struct lineReader *reader = &stdinReader;
+    if (interactive == 0) {
+        reader->capacity = 1 << 16;
+        reader->buf = malloc(reader->capacity);
+    }
+    size_t len = 0;
+    ssize_t read;
+
+    // Loop until the user enters "exit"
+    do {
+
+        removeProcesses(&jobTable);
+        refillPool();
+        announceForegroundMode();
+
+        // Print the prompt and get the user input
+        read = promptLine(reader, ": ", &userInput, &len);
+
+        // End of input works like exit
+        if (read == -1) {
+            free(reader->buf);
+            free(userInput);
+            freeProcess(currProc);
+            executeExit(&jobTable);
+        }
+
+        // If the user entered only whitespace or a comment, then jump to next iteration
+        if (isBlankLine(userInput)) {
+            continue;
+        }
+
+        // !! and !prefix run a line from the history, the line that runs is what gets added
+        if (userInput[0] == '!' && !isspace((unsigned char)userInput[1])) {
+            if (expandHistory(&userInput, &len) == -1) {
+                continue;
+            }
+            read = strlen(userInput);
+        }
+        if (interactive == 1) {
+            addHistory(userInput, read > 0 && userInput[read - 1] == '\n' ? read - 1 : read);
+        }
+
+        // Replace the new line character with a space
+        if (read > 0 && userInput[read - 1] == '\n') {
+            userInput[read - 1] = ' ';
+        }
+
+        // Parse the command, or find it in the cache, and run it
+        interrupted = 0;
+        runNode(parseInteractive(reader, userInput));
+
+    } while (strcmp(userInput, "exit ") != 0);
+
+    free(userInput);
+    freeProcess(currProc);
+    freeJobTable(&jobTable);
+
+    return 0;
+}